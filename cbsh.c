@@ -16,58 +16,640 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 **/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "linenoise/linenoise.h"
 #include "linenoise/encodings/utf8.h"
 
 #include "config.h"
 
-#define NUM_BUILTINS    15
+/* glibc can hand the terminal to a spawned child since 2.35 */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP
+#endif
+
+#define NUM_BUILTINS    (sizeof(builtins) / sizeof(struct builtin))
+#define BUILTIN_SLOTS   128
+#define ARENA_CHUNK     4096
+#define INPUT_CHUNK     65536
+#define ALIAS_BUCKETS   64
+#define ALIAS_MAXDEPTH  32
+#define FUNCTION_BUCKETS 64
+#define FUNCTION_MAXDEPTH 256
+#define REDIR_MARK      '\x1f'      /* starts redirection operators dtmparse found */
+#define REDIR_OPEN      0
+#define REDIR_DUP       1
+#define REDIR_CLOSE     2
+#define REDIR_DATA      3
+#define GITCACHESIZE    8
+#define HISTORY_MATCHES 32      /* shown for a ! line on tab */
+#define COMPLETION_TOPK 32      /* best candidates shown on tab */
+#define USAGE_BUCKETS   256
+#define HASH_BUCKETS    64
+#define VAR_BUCKETS     256
+#define CMDCACHE_MAGIC  "cbshidx"
+#define CMDCACHE_VERSION 1
+#define PROMPT_TEXT     0
+#define PROMPT_USER     1
+#define PROMPT_HOST     2   /* up to the first dot */
+#define PROMPT_FULLHOST 3
+#define PROMPT_CWD      4   /* as it is, for %3$s */
+#define PROMPT_TILDECWD 5   /* home shortened to ~ */
+#define PROMPT_BASENAME 6
+#define PROMPT_DOLLAR   7
+#define PROMPT_STATUS   8
+#define PROMPT_GIT      9
+#define PROMPT_DEP_CWD      (1 << 0)
+#define PROMPT_DEP_STATUS   (1 << 1)
+#define PROMPT_DEP_GIT      (1 << 2)
+
+#define PROC_RUNNING    0
+#define PROC_STOPPED    1
+#define PROC_DONE       2
+#define JOB_RUNNING     PROC_RUNNING
+#define JOB_STOPPED     PROC_STOPPED
+#define JOB_DONE        PROC_DONE
 
 /* types */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+struct arena {
+    struct arena_chunk *head;
+    void *last;         /* last allocation, can be grown in place */
+};
+struct shell_var {
+    char *entry;                /* name=value, NULL if exported before it was set */
+    const char *value;          /* points into entry */
+    char *name;
+    int exported;
+    int published;              /* entry is in var_envp */
+    struct shell_var *next;
+};
+struct var_overlay {
+    char *const *assigns;       /* NAME=value, later ones win */
+    int count;
+    struct var_overlay *outer;
+};
+struct command_hash {
+    char *name;
+    char *path;                 /* where name was found in PATH */
+    unsigned int hits;
+    struct command_hash *next;
+};
 struct command_alias {
     char *alias;
     char *command;
+    char **argv;                /* pre-tokenized command, NULL if it has to be parsed on every use */
+    int argc;
+    struct arena tokens;        /* backs argv */
+    char **expanded;            /* memoized expansion of the whole alias chain */
+    int expanded_c;
+    unsigned long expanded_gen; /* valid while this equals alias_generation */
+    struct command_alias *next;
+};
+struct line_command {
+    char *text;
+    int op;                     /* 0: always run, 1: after success (&&), 2: after failure (||) */
+    int background;
+};
+struct parse_state {
+    char *out;                  /* the words, NUL-separated */
+    size_t len;
+    size_t alloc;
+    char **words;               /* NULL marks a | */
+    int word_c;
+    int word_alloc;
+    int open;                   /* the current word has started, even if it's still empty */
+    struct arena *arena;
+};
+struct function_command {
+    char *text;                 /* source text, names the job */
+    char **words;               /* NULL marks a |, like in dtmparse */
+    unsigned char *expand;      /* words that still go through dtmparse on every call */
+    int word_c;
+    int op;                     /* 0: always run, 1: after success (&&), 2: after failure (||) */
+    int background;
 };
 struct shell_function {
     char *name;
-    char ***commands;
+    struct function_command *commands;
+    int command_c;
+    int refs;                   /* the table and every running call hold one */
+    struct arena arena;         /* backs everything above */
+    struct shell_function *next;
+};
+struct input_source {
+    int interactive;    /* read lines with linenoise */
+    int fd;             /* fd to read more from, -1 if everything is in buf */
+    char *buf;
+    size_t len;
+    size_t pos;
+    size_t alloc;
+    int mapped;
+};
+struct redirect {
+    int fd;             /* the fd the command sees */
+    int type;           /* REDIR_OPEN, REDIR_DUP, REDIR_CLOSE or REDIR_DATA */
+    int flags;          /* open(2) flags for REDIR_OPEN */
+    char *path;         /* file for REDIR_OPEN */
+    int dupfd;          /* fd to copy for REDIR_DUP */
+    const char *data;   /* here-doc or here-string for REDIR_DATA */
+    int src;            /* opened by openredirs, -1 if there's nothing to close */
+};
+struct history_gram {
+    unsigned int gram;  /* three bytes of a line, 0 marks a free slot */
+    int *ids;           /* entries containing it, ascending */
+    int count;
+    int alloc;
+};
+struct command_usage {
+    char *name;
+    unsigned int count;     /* history lines it started */
+    unsigned long last;     /* number of the newest of those lines */
+    struct command_usage *next;
+};
+struct candidate {
+    const char *name;   /* points into the index, a listing or a table, never copied */
+    int score;
+    int color;
+    const struct dir_listing *listing;  /* the name is from, NULL for commands */
+};
+struct completion_context {
+    size_t start;       /* where the word starts in the line */
+    size_t base;        /* where the part that's matched starts, after the last / or the $ */
+    int command;        /* the word is a command name */
+    int dirsonly;       /* the command only takes dirs */
+    int variable;       /* the word starts with $ */
+    char dir[MAXCURDIRLEN];     /* the dir the word is in, unescaped */
+};
+struct candidate_heap {
+    struct candidate items[COMPLETION_TOPK];    /* min-heap, the worst one is items[0] */
+    int count;
+    int limit;
+};
+struct history {
+    int fd;             /* the log, opened with O_APPEND, -1 if nothing is saved */
+    char **entries;     /* oldest first: the tail of the log, then this session */
+    int count;
+    int alloc;
+    int base;           /* number of entries dropped before entries[0] */
+    int indexed;        /* entries already in grams */
+    struct history_gram *grams;
+    unsigned int gram_slots;
+    unsigned int gram_c;
+};
+struct prompt_segment {
+    int type;           /* PROMPT_* */
+    const char *text;   /* PROMPT_TEXT only */
+    size_t len;
+};
+struct prompt_template {
+    char *source;       /* the PS1 this was compiled from */
+    struct prompt_segment *segments;
+    int count;
+    int deps;           /* PROMPT_DEP_*, what makes a new rendering necessary */
+    char *rendered;     /* NULL if it has to be rendered again */
+    char *cwd;          /* state rendered was made for */
+    int status;
+    char *branch;
+};
+struct git_cache_entry {
+    char *dir;
+    char *statpath;     /* HEAD, or dir itself if it isn't in a repo */
+    struct timespec mtime;
+    char *branch;       /* NULL outside of repos */
+    unsigned long lastuse;
+};
+struct pipe_stage {
+    char **argv;    /* NULL-terminated */
+    int argc;
+    struct redirect *redirs;
+    int redir_c;
+    char **assigns; /* NAME=value words in front of argv, only for this command */
+    int assign_c;
+};
+struct builtin {
+    const char *name;
+    int (*func)(int argc, char *const argv[]);
+    int capture;        /* no side effects, $( ) runs it in-process */
+};
+struct job {
+    int id;
+    pid_t pgid;         /* 0 without job control */
+    int nprocs;
+    pid_t *pids;
+    int *status;        /* exit code of every process */
+    char *procstate;    /* PROC_RUNNING, PROC_STOPPED or PROC_DONE */
+    int background;
+    int notify;         /* finished or stopped since the last prompt */
+    char *command;
+    long long utime;    /* cpu time of the processes that are done, in us */
+    long long stime;
+    long maxrss;        /* in KiB */
+};
+/* where the time of one command went, in ns unless noted */
+struct command_trace {
+    long long parse;
+    long long alias;    /* splitting up the pipeline and expanding aliases */
+    long long spawn;
+    long long wait;
+    long long utime;    /* cpu time of its children, from wait4, in us */
+    long long stime;
+    long maxrss;        /* in KiB */
+    struct command_trace *outer;
+};
+struct command_entry {
+    const char *name;
+    int dir;        /* index into command_index.dirs, -1 if not in PATH */
+    int builtin;
+};
+struct command_index {
+    struct command_entry *entries;
+    size_t count;
+    char **dirs;        /* the PATH dirs entry->dir counts in */
+    int dir_c;
+    void **retired;     /* listing buffers only the index before this one uses */
+    int retired_c;
+};
+/**
+ * the command index cache file is a cmdcache_header, the
+ * dirs, the entries, the offsets of every dir's names and
+ * then all strings. offsets count from the start of the
+ * file, names have their d_type in front like in listings.
+**/
+struct cmdcache_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int builtins;  /* hash of the builtin names, builds with other builtins don't match */
+    unsigned int dir_c;
+    unsigned int count;     /* entries */
+    unsigned int path;      /* offset of the PATH this is for */
+    unsigned int name_c;    /* names of all dirs together */
+};
+struct cmdcache_dir {
+    long long sec;          /* mtime */
+    long long nsec;
+    unsigned int path;
+    unsigned int first;     /* index of its first name offset */
+    unsigned int count;
+    unsigned int pad;
+};
+struct cmdcache_entry {
+    unsigned int name;
+    int dir;
+    int builtin;
+};
+struct dir_listing {
+    char *path;
+    struct timespec mtime;
+    char *names;        /* every name in the dir, NUL-separated, each after its d_type */
+    const char **list;  /* sorted pointers into names */
+    size_t count;
+    unsigned long lastuse;
 };
 
 /* functions */
-int shell_mainloop();
+int shell_mainloop(struct input_source *input, struct arena *arena);
+int shell_runline(char *command, struct arena *arena);
+int runcommand(char **cmd_argv, int count, int background, const char *command_text, struct arena *arena);
+int runparsed(char **cmd_argv, int count, int background, const char *command_text, struct arena *arena);
+long long nowns();
+void formattime(char *buf, size_t len, long long us);
+void writetrace(const struct command_trace *cmdtrace, const char *command_text, int status, const struct timespec *start, long long total);
+size_t jsonescape(char *out, size_t outlen, const char *str);
+void input_open(struct input_source *input, int fd);
+void input_string(struct input_source *input, char *str);
+char *input_readline(struct input_source *input, const char *prompt, struct arena *arena);
+void input_close(struct input_source *input);
+void stripcomment(char *line);
+void historyopen(const char *path);
+void historyadd(const char *line, int save);
+void historyindex();
+struct history_gram *historygram(unsigned int gram, int create);
+int historysearch(const char *text, int prefix, int before);
+const char *historyevent(const char *spec, size_t *speclen);
+char *expandhistory(const char *line);
+const char *renderprompt();
+void compileprompt(const char *source);
+const char *gitbranch(const char *dir);
+char *readgithead(const char *dir, char **statpath);
 int parse_builtin(int argc, char *const argv[]);
+const struct builtin *findbuiltin(const char *name);
+void initbuiltins();
+unsigned int strhash(const char *name, unsigned int seed);
+int builtin_exit(int argc, char *const argv[]);
+int builtin_cd(int argc, char *const argv[]);
+int builtin_export(int argc, char *const argv[]);
+int builtin_assign(int argc, char *const argv[]);
+int builtin_getenv(int argc, char *const argv[]);
+int builtin_builtin(int argc, char *const argv[]);
+int builtin_command(int argc, char *const argv[]);
+int builtin_echo(int argc, char *const argv[]);
+int builtin_colon(int argc, char *const argv[]);
+int builtin_source(int argc, char *const argv[]);
+int builtin_alias(int argc, char *const argv[]);
+int builtin_unalias(int argc, char *const argv[]);
+int builtin_jobs(int argc, char *const argv[]);
+int builtin_fg(int argc, char *const argv[]);
+int builtin_wait(int argc, char *const argv[]);
+int builtin_return(int argc, char *const argv[]);
+int builtin_history(int argc, char *const argv[]);
+int builtin_hash(int argc, char *const argv[]);
+int builtin_times(int argc, char *const argv[]);
 int spawnwait(char *const argv[]);
+int runpipeline(struct pipe_stage *stages, int nstages, int background, const char *command);
+pid_t launchstage(struct pipe_stage *stage, int in, int out, pid_t pgid, int background, int builtin);
+struct job *addjob(pid_t *pids, int nprocs, pid_t pgid, const char *command);
+void removejob(struct job *job);
+int jobstate(const struct job *job);
+struct job *findjob(const char *spec);
+void printjob(const struct job *job);
+void reapchildren();
+int waitjob(struct job *job);
+void continuejob(struct job *job);
+int foreground(struct job *job, int cont);
+void notifyjobs(int interactive);
+void sigchld_handler(int sig);
+void resetsigchld();
+int splitredirs(struct pipe_stage *stage, struct arena *arena);
+int openredirs(struct pipe_stage *stage);
+void closeredirs(struct pipe_stage *stage);
+int applyredirs(const struct pipe_stage *stage);
+int swapredirs(struct pipe_stage *stage, int *saved);
+void restoreredirs(const struct pipe_stage *stage, const int *saved);
+int datafd(const char *data, size_t len);
+void collectheredocs(struct input_source *input, const char *line, struct arena *arena);
+char *expandheredoc(const char *body, struct arena *arena);
+int isbuiltin(const char *name);
+int waitstatus_code(int waitstatus);
+struct command_alias *findalias(const char *name);
+int setalias(const char *name, const char *command);
+int removealias(const char *name);
+void freealias(struct command_alias *alias);
+char **resolvealias(struct command_alias *alias, int *count, struct arena *arena);
+void expandalias(char ***argv, int *count, struct arena *arena);
+char *finddefinition(char *line);
+size_t definitionname(const char *pos);
+char *definefunction(struct input_source *input, char *line, struct arena *arena);
+void compilefunction(struct shell_function *function, char *body);
+struct shell_function *findfunction(const char *name);
+void releasefunction(struct shell_function *function);
+int callfunction(struct shell_function *function, int argc, char **argv, struct arena *arena);
+const char *lookupvar(const char *name);
+void importenv();
+struct shell_var *findvar(const char *name);
+const char *getvar(const char *name);
+const char *overlayvalue(const char *name);
+char **childenv();
+int samevar(const char *entry, const char *other);
+int splitassigns(struct pipe_stage *stage);
+int setvar(const char *name, const char *value, int export);
+int validname(const char *name, size_t len);
+char **exportvars();
 void dtmsplit(char *str, char *delim, char ***array, int *length);
-void dtmparse(char *str, char ***array, int *length);
-void buildhints(const char *targetdir);
-void buildcommands();
+void dtmparse(char *str, char ***array, int *length, struct arena *arena);
+void parse_reserve(struct parse_state *ps, size_t extra);
+void parse_open(struct parse_state *ps);
+void parse_append(struct parse_state *ps, const char *src, size_t len);
+void parse_endword(struct parse_state *ps);
+void parse_push(struct parse_state *ps, char *word);
+int parse_inassign(const struct parse_state *ps);
+struct line_command *splitline(char *line, int *count, struct arena *arena);
+int substitution_end(const char *str, int start);
+char *substitute(const char *command, size_t *len, struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t oldsize, size_t newsize);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+const struct dir_listing *getlisting(const char *targetdir);
+void startindexer();
+void *indexer_main(void *arg);
+void updatecommands();
+void takecommands();
+struct command_index *buildcommands(const char *pathenv);
+void retirelisting(struct dir_listing *listing, struct command_index *index);
+struct command_index *loadcmdcache(const char *pathenv);
+void savecmdcache(const struct command_index *index);
+unsigned int builtinshash();
+void freecmdindex(struct command_index *index);
+int scanlisting(struct dir_listing *listing, int escape, struct command_index *retire);
+void freelisting(struct dir_listing *listing);
+size_t listing_lowerbound(const struct dir_listing *listing, const char *prefix, size_t prefixlen);
+int namecompare(const void *a, const void *b);
+int cmdentry_compare(const void *a, const void *b);
+size_t cmdindex_lowerbound(const char *prefix, size_t prefixlen);
+const struct command_entry *cmdindex_find(const char *name);
+int cmdindex_resolve(const char *name, char *path, size_t pathlen);
+int cmdindex_current();
+int searchpath(const char *name, char *path, size_t pathlen);
+struct command_hash *findhash(const char *name);
+struct command_hash *resolvehash(const char *name);
+struct command_hash *sethash(const char *name, const char *path);
+int forgethash(const char *name);
+void clearhash();
 int startswith(const char *str, const char *prefix);
 int haschar(const char *haystack, const char needle);
 int countchar(const char *haystack, const char needle);
+void recordusage(const char *line);
+int usagescore(const char *name);
+int matchscore(const char *name, const char *word, size_t wordlen);
+int candidate_worse(const struct candidate *a, const struct candidate *b);
+void siftcandidate(struct candidate_heap *heap, int pos);
+void offercandidate(struct candidate_heap *heap, const char *name, int score, int color, const struct dir_listing *listing);
+int completioncontext(const char *buf, struct completion_context *ctx);
+const struct dir_listing *getvariables();
+int listingisdir(const struct dir_listing *listing, const char *name);
+void rankcommands(struct candidate_heap *heap, const char *word, int fuzzy);
+void ranklisting(struct candidate_heap *heap, const struct dir_listing *listing, const char *word, int fuzzy, int color, int dirsonly);
+void rankcompletions(struct candidate_heap *heap, const char *buf, const struct completion_context *ctx, int fuzzy);
+void sortcandidates(struct candidate_heap *heap);
 char *hints(const char *buf, int *color, int *bold);
 void completion(const char *buf, linenoiseCompletions *lc);
 int panic(const char *error, const char *details);
 
+extern char **environ;
+
+/**
+ * shell variables, hashed by name. exported ones are copied
+ * into var_envp before the next child is started, entries
+ * replaced until then are kept in var_retired, environ might
+ * still point to them.
+**/
+struct shell_var *var_table[VAR_BUCKETS];
+unsigned int var_c = 0, var_exported = 0;
+char **var_envp = NULL;
+int var_dirty = 1;
+char **var_retired = NULL;
+int var_retired_c = 0;
+
+/* assignments in front of the command that's running, they hide the table */
+struct var_overlay *var_overlay = NULL;
+
 /* "environment" variables */
-char *ps1;
 char *username;
 char *hostname;
 char *curdir;
 char *homedir;
 
+/* everything allocated while running one input line */
+struct arena line_arena = { NULL, NULL };
+
+/* status of the last command, exit was called */
+int last_status = 0;
+int exit_requested = 0;
+
+/* exit status of every stage of the last pipeline */
+int *pipestatus = NULL;
+int pipestatus_c = 0;
+
+/* here-document bodies of the current line, in order */
+char **heredocs = NULL;
+int heredoc_c = 0, heredoc_next = 0;
+
+/* whether children get their own process groups and the terminal */
+int jobcontrol = 0;
+
+/* job table, jobs[n - 1] is job n */
+struct job **jobs = NULL;
+int job_c = 0;
+int sigchld_pipe[2] = { -1, -1 };
+
+/* how many children were started with posix_spawn and fork, shown on exit with DEBUG_OUTPUT */
+unsigned long launches_spawn = 0, launches_fork = 0;
+
+/**
+ * timings of the innermost command that's running, the
+ * parse time of the next one and where trace records go
+ * (CBSH_TRACEFD, -1 for nowhere).
+**/
+struct command_trace *trace = NULL;
+long long trace_parse = 0;
+int trace_fd = -1;
+unsigned long trace_seq = 0;
+
+/**
+ * all builtins, parse_builtin and completion both use this
+ * table, so adding a builtin here is all it takes.
+**/
+const struct builtin builtins[] = {
+    { "cd",           builtin_cd,       0 },
+    { "chdir",        builtin_cd,       0 },
+    { "exit",         builtin_exit,     0 },
+    { "logout",       builtin_exit,     0 },
+    { "export",       builtin_export,   0 },
+    { "setenv",       builtin_export,   0 },
+    { "getenv",       builtin_getenv,   1 },
+    { "builtin",      builtin_builtin,  0 },
+    { "command",      builtin_command,  0 },
+    { "echo",         builtin_echo,     1 },
+    { ":",            builtin_colon,    1 },
+    { ".",            builtin_source,   0 },
+    { "source",       builtin_source,   0 },
+    { "alias",        builtin_alias,    0 },
+    { "unalias",      builtin_unalias,  0 },
+    { "jobs",         builtin_jobs,     0 },
+    { "fg",           builtin_fg,       0 },
+    { "bg",           builtin_fg,       0 },
+    { "wait",         builtin_wait,     0 },
+    { "return",       builtin_return,   0 },
+    { "history",      builtin_history,  1 },
+    { "hash",         builtin_hash,     0 },
+    { "times",        builtin_times,    1 },
+};
+
+/* perfect hash table over builtins, slot holds index + 1 */
+unsigned char builtin_slots[BUILTIN_SLOTS];
+unsigned int builtin_seed = 0;
+
+/* command history */
+struct history history = { -1, NULL, 0, 0, 0, 0, NULL, 0, 0 };
+
+/* how often and how recently every command was run */
+struct command_usage *usage_table[USAGE_BUCKETS];
+unsigned long usage_clock = 0;
+
+/* the prompt, compiled from PS1 */
+struct prompt_template prompt_template = { NULL, NULL, 0, 0, NULL, NULL, 0, NULL };
+struct git_cache_entry gitcache[GITCACHESIZE];
+unsigned long gitcache_clock = 0;
+
+/**
+ * the command index is built on the indexer thread and
+ * published through cmdindex_published. the main thread
+ * swaps it in before a prompt and then uses cmdindex
+ * without locking, the indexer never touches it again.
+**/
+struct command_index cmdindex_empty = { NULL, 0, NULL, 0, NULL, 0 };
+struct command_index *cmdindex = &cmdindex_empty;
+struct command_index *_Atomic cmdindex_published = NULL;
+atomic_int indexer_busy = 0;
+int indexer_running = 0;
+pthread_t indexer;
+pthread_mutex_t indexer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t indexer_wake = PTHREAD_COND_INITIALIZER;
+char *indexer_path = NULL;      /* PATH to scan next, under indexer_lock */
+
+/* the PATH listings, only the indexer thread uses these */
+struct dir_listing *pathdirs = NULL;
+int pathdir_c = 0;
+char *pathdirs_env = NULL;
+int pathdirs_indexed = 0;
+
+/* where the index is cached between shells, NULL if it isn't */
+char *cmdcache_path = NULL;
+
 /* autocomplete globals */
-char **commands = NULL;
-char **files = NULL;
-struct command_alias **aliases = NULL;
-struct shell_function **functions = NULL;
-unsigned int alias_c = 0, function_c = 0;
+struct dir_listing dircache[DIRCACHESIZE];
+unsigned long dircache_clock = 0;
+struct dir_listing variables;
+
+/* functions, hashed by name */
+struct shell_function *function_table[FUNCTION_BUCKETS];
+unsigned int function_c = 0;
+int function_depth = 0, function_return = 0;
+
+/* status return hands to callfunction, kept out of the builtin action codes */
+int return_status = 0;
+
+/* positional parameters, $0 always names the shell or script */
+char *shell_name = "cbsh";
+char **posparams = NULL;
+int posparam_c = 0;
+
+/* aliases, hashed by name. any change bumps alias_generation */
+struct command_alias *alias_table[ALIAS_BUCKETS];
+unsigned int alias_c = 0;
+unsigned long alias_generation = 1;
+
+/* where commands were found in PATH, emptied whenever PATH changes */
+struct command_hash *hash_table[HASH_BUCKETS];
+int hash_indexok = -1;      /* if cmdindex matches PATH, -1 if not checked yet */
 
 /**
  * flags that control cbsh's behaviour
@@ -78,17 +660,30 @@ unsigned int alias_c = 0, function_c = 0;
  * ||- [reserved for future use]
  * |||- [reserved for future use]
  * ||||- [reserved for future use]
- * |||| |- [reserved for future use]
- * |||| ||- [reserved for future use]
+ * |||| |- parse only, don't run anything
+ * |||| ||- non-interactive (script) mode
  * |||| |||- history disable
  * 0000 0000- multiline mode
 **/
 unsigned int flags = 0;
 
 int main(int argc, char **argv) {
+    struct input_source input;
+    char *script = NULL, *command_string = NULL;
+
+    shell_name = argv[0];
+    posparams = argv;
+    posparam_c = 1;
+
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] != '-')
-            return panic("unrecognized option", "files are not supported yet.");
+        /* first non-option argument is the script to run, the rest are its arguments */
+        if (argv[i][0] != '-') {
+            script = argv[i];
+            shell_name = script;
+            posparams = argv + i;
+            posparam_c = argc - i;
+            break;
+        }
 
         switch (argv[i][1]) {
             case 'm':
@@ -97,6 +692,14 @@ int main(int argc, char **argv) {
             case 'H':
                 flags |= 1 << 1;
                 break;
+            case 'n':
+                flags |= 1 << 3;
+                break;
+            case 'c':
+                if (++i >= argc)
+                    return panic("missing argument", "-c requires a command string");
+                command_string = argv[i];
+                break;
             case 'v':
                 printf("cbsh - version 0.4\n");
                 return 0;
@@ -105,33 +708,91 @@ int main(int argc, char **argv) {
         }
     }
 
-
-    /* fetch prompt */
-    if ((ps1 = getenv("PS1")) == NULL) {
-        ps1 = malloc(sizeof(char) * (strlen(DEFAULTPROMPT) + 1));
-        strcpy(ps1, DEFAULTPROMPT);
+    /* figure out where to read commands from */
+    if (command_string) {
+        input_string(&input, command_string);
+    } else if (script) {
+        int fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(script);
+            return 127;
+        }
+        input_open(&input, fd);
+    } else if (!isatty(STDIN_FILENO)) {
+        input_open(&input, STDIN_FILENO);
+    } else {
+        memset(&input, 0, sizeof(struct input_source));
+        input.interactive = 1;
+        input.fd = -1;
     }
 
+    if (!input.interactive)
+        flags |= 1 << 2;
+
     /* fetch "environment" variables */
-    username = getenv("USER");
+    importenv();
+
+    /* CBSH_TRACEFD=n writes a trace record for every command to fd n */
+    const char *tracefd = getvar("CBSH_TRACEFD");
+    if (tracefd && tracefd[0] != '\0' && strspn(tracefd, "0123456789") == strlen(tracefd)
+            && atoi(tracefd) > 0 && fcntl(atoi(tracefd), F_GETFD) != -1) {
+        trace_fd = atoi(tracefd);
+        /* children don't inherit it */
+        fcntl(trace_fd, F_SETFD, fcntl(trace_fd, F_GETFD) | FD_CLOEXEC);
+    }
+    username = getvar("USER") ? strdup(getvar("USER")) : NULL;
     if (!username) {
         username = malloc(sizeof(char) * 6);
         strcpy(username, "emily");
     }
-    hostname = getenv("HOSTNAME");
+    hostname = getvar("HOSTNAME") ? strdup(getvar("HOSTNAME")) : NULL;
     if (!hostname) {
         hostname = malloc(sizeof(char) * 8);
         strcpy(hostname, "chiyoko");
     }
     curdir = malloc(sizeof(char) * MAXCURDIRLEN);
-    strcpy(curdir, getenv("HOME"));
+    snprintf(curdir, MAXCURDIRLEN, "%s", getvar("HOME") ? getvar("HOME") : "");
     if (curdir[0] == '\0')
         strcpy(curdir, "/");
     homedir = strdup(curdir);
 
+    /* init builtins, aliases & shell functions */
+    initbuiltins();
+
+    /* children are collected whenever SIGCHLD pokes the self-pipe */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    /* scripts run where they were started from and don't need any of the interactive stuff */
+    if (flags & 1 << 2) {
+        if (!getcwd(curdir, MAXCURDIRLEN))
+            strcpy(curdir, "/");
+        setvar("PWD", curdir, 1);
+
+        int shell_return_value = shell_mainloop(&input, &line_arena);
+        input_close(&input);
+#ifdef DEBUG_OUTPUT
+        fprintf(stderr, "started %lu children with posix_spawn and %lu with fork\n", launches_spawn, launches_fork);
+#endif
+        return shell_return_value;
+    }
+
+    /* put ourselves in our own process group and take the terminal */
+    jobcontrol = 1;
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    setpgid(0, 0);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+
     /* go to home directory and set $PWD*/
     chdir(curdir);
-    setenv("PWD", curdir, 1);
+    setvar("PWD", curdir, 1);
 
     /* init UTF-8 support */
     linenoiseSetEncodingFunctions(linenoiseUtf8PrevCharLen, linenoiseUtf8NextCharLen, linenoiseUtf8ReadCode);
@@ -142,771 +803,4858 @@ int main(int argc, char **argv) {
     /* load history if HOME was found */
     linenoiseHistorySetMaxLen(HISTSIZE);
     if (strcmp(homedir, "/")) {
-        if (!(flags & 1 << 1))
-            linenoiseHistoryLoad(".cbsh_history");
+        if (!(flags & 1 << 1)) {
+            char *histfile = malloc(sizeof(char) * (strlen(homedir) + 15));
+            sprintf(histfile, "%s/.cbsh_history", homedir);
+            historyopen(histfile);
+            free(histfile);
+        }
     } else {
         fprintf(stderr, "warning: could not fetch home directory, disabling history.\n");
     }
 
-    /* init tab complete & hints */
-    buildhints(".");
-    buildcommands();
+    /* init tab complete & hints, PATH is read in the background */
+    startindexer();
     linenoiseSetCompletionCallback(completion);
     linenoiseSetHintsCallback(hints);
 
-    /* init aliases & shell functions */
-    aliases = malloc(sizeof(struct command_alias *));
-    functions = malloc(sizeof(struct shell_function *));
-
-    /* run the shell's mainloop */
-    int shell_return_value = shell_mainloop();
-
-    /* save history file */
-    chdir(homedir);
-    if (strcmp(homedir, "/") && !(flags & 1 << 1))
-        linenoiseHistorySave(".cbsh_history");
+    /* run the shell's mainloop, history is saved as it goes */
+    int shell_return_value = shell_mainloop(&input, &line_arena);
 
     printf("logout\n");
+#ifdef DEBUG_OUTPUT
+    fprintf(stderr, "started %lu children with posix_spawn and %lu with fork\n", launches_spawn, launches_fork);
+#endif
     return shell_return_value;
 }
 
 /**
  * cbsh's mainloop
- * parses, runs, etc. until exit is called
-**/
-int shell_mainloop() {
-    int running = 1, parse_next = 1;
-
-    char *command = NULL, *command_token = NULL;
-    size_t maxprompt = strlen(DEFAULTPROMPT) + strlen(username) + strlen(hostname) + MAXCURDIRLEN;
-    char *prompt = malloc(sizeof(char) * maxprompt);
-    int i, parse_pos = 0, parse_pos_max = 0, exit_expect = -1, exit_expect_satisfy = 0;
-
-    // init $?
-    char exit_str[20] = { 0 };
-    strcpy(exit_str, "0");
-    setenv("?", exit_str, 1);
-
-    while (running) {
-        /* print promt & read command (liblinenoise approach) */
-        snprintf(prompt, maxprompt, ps1, username, hostname, curdir);
-        command = linenoise(prompt);
-        if (command) {
-            linenoiseHistoryAdd(command);
-        } else {
-            running = 0;
-            break;
+ * reads lines from input and runs them until
+ * exit is called or input runs out
+**/
+int shell_mainloop(struct input_source *input, struct arena *arena) {
+    char *command = NULL, *rest;
+    const char *prompt = NULL;
+    char **saved_heredocs = heredocs;
+    int status, saved_heredoc_c = heredoc_c, saved_heredoc_next = heredoc_next;
+
+    while (!exit_requested) {
+        /* collect children that changed state and report finished jobs */
+        notifyjobs(input->interactive);
+
+        if (input->interactive) {
+            /* pick up new binaries in PATH (only rescans changed dirs) */
+            updatecommands();
+
+            /* print promt & read command (liblinenoise approach) */
+            prompt = renderprompt();
         }
 
-        parse_next = 1, parse_pos = 0, parse_pos_max = strlen(command) + 1, exit_expect = -1, exit_expect_satisfy = 0;
-
-        while (parse_next) {
-            parse_next = !(parse_pos == parse_pos_max);
-
-            /* parse next command */
-            command_token = command + parse_pos + (parse_pos != 0) - ((parse_pos == parse_pos_max) * 2);
-            for (; parse_pos < parse_pos_max; parse_pos++) {
-                if (command[parse_pos] == ';') {
-                    command[parse_pos] = '\0';
-                    exit_expect = -1;
-                } else if (parse_pos == 0) {
-                    continue;
-                } else if (command[parse_pos - 1] == '&' && command[parse_pos] == '&') {
-                    command[parse_pos - 1] = '\0';
-                    exit_expect = 0;
-                } else if (command[parse_pos - 1] == '|' && command[parse_pos] == '|') {
-                    command[parse_pos - 1] = '\0';
-                    exit_expect = 1;
-                } else {
-                    continue;
-                }
+        if ((command = input_readline(input, prompt, arena)) == NULL)
+            break;
 
-                if (exit_expect_satisfy & (1 << 1)) {
-                    command_token = command + parse_pos + (parse_pos != 0)  - ((parse_pos == parse_pos_max) * 2);
-                    exit_expect_satisfy = 0;
-                } else {
+        /* function definitions may follow other commands and continue on the following lines */
+        status = -1;
+        while ((rest = finddefinition(command)) != NULL) {
+            if (rest > command) {
+                /* the commands in front of it run first */
+                char *before = arena_strdup(arena, command);
+                before[rest - command] = '\0';
+                collectheredocs(input, before, arena);
+                if ((status = shell_runline(before, arena)) != -1)
                     break;
-                }
             }
+            if ((rest = definefunction(input, rest, arena)) == NULL)
+                break;
+            command = rest;
+        }
 
-            /* remove leading spaces */
-            while (command_token[0] == ' ') {
-                command_token++;
-            }
+        if (status == -1) {
+            /* here-documents are read from the lines after this one */
+            collectheredocs(input, command, arena);
 
-            /* allow semicolon at end of last command */
-            if (command_token[0] == '\0')
-                break;
+            status = shell_runline(command, arena);
+        }
 
-            /* read command to arg list */
-            char **cmd_argv = NULL;
-            int count = 0;
-            dtmparse(command_token, &cmd_argv, &count);
+        /* free stuff that is no longer used */
+        arena_reset(arena);
 
-            if (count == 0) {
-                break;
-            }
+        if (status != -1) {
+            exit_requested = 1;
+            last_status = status;
+        }
+    }
 
-            cmd_argv[count] = NULL;
+    /* a sourced file must not eat the here-documents of the line that sourced it */
+    heredocs = saved_heredocs;
+    heredoc_c = saved_heredoc_c;
+    heredoc_next = saved_heredoc_next;
+    return last_status;
+}
 
-            /* exclamation mark shorthands */
-            if (cmd_argv[0][0] == '!') {
-                panic("not implemented", "linenoise, the line editing library used by cbsh, doesn't allow the program to read the history. thus, implementing exclamation mark shorthands is not possible.\n");
-                break;
-            }
+/**
+ * runs one line of input
+ * returns -1 to keep going or the status
+ * to exit the shell with
+**/
+int shell_runline(char *command, struct arena *arena) {
+    struct line_command *commands;
+    int count, cmd;
 
-            /* find possible alias */
-            unsigned int aliascheck;
-            for (aliascheck = 0; aliascheck < alias_c; aliascheck++) {
-                if (!strcmp(cmd_argv[0], aliases[aliascheck]->alias)) {
-                    char **cmd_argv_new = NULL;
-                    int count_new = 0, offset = 0;
+    stripcomment(command);
+    commands = splitline(command, &count, arena);
 
-                    dtmparse(strdup(aliases[aliascheck]->command), &cmd_argv_new, &count_new);
-                    cmd_argv_new = realloc(cmd_argv_new, sizeof(char *) * (count_new + count + 1));
+    for (cmd = 0; cmd < count; cmd++) {
+        /* && and || look at the last command that ran, a skipped one leaves the status alone */
+        if ((commands[cmd].op == 1 && last_status != 0) || (commands[cmd].op == 2 && last_status == 0))
+            continue;
 
-                    for (; offset <= count; offset++) {
-                        cmd_argv_new[count_new + offset] = cmd_argv[offset + 1];
-                    }
-                    count = count_new + count - 1;
+        /* keep the text around for the job table, parsing writes into it */
+        char *command_text = arena_strdup(arena, commands[cmd].text);
 
-                    /* avoid self-binding problems */
-                    if (!strcmp(cmd_argv[0], cmd_argv_new[0])) {
-                        cmd_argv = cmd_argv_new;
-                        break;
-                    } else {
-                        cmd_argv = cmd_argv_new;
-                        aliascheck = -1;
-                    }
-                }
-            }
+        /* read command to arg list */
+        char **cmd_argv = NULL;
+        int argc = 0;
+        long long started = nowns();
+        dtmparse(commands[cmd].text, &cmd_argv, &argc, arena);
+        trace_parse = nowns() - started;
 
-#ifdef DEBUG_OUTPUT
-            printf("parsed command: ");
-            for (i = 0; i < count; i++) {
-                printf("[%s]", cmd_argv[i]);
-            }
-            printf("\n");
-            fflush(stdout);
-#endif
+        /* -n only parses */
+        if (argc == 0 || flags & 1 << 3)
+            continue;
 
-            /* run command */
-            int exit_code = 0;
-            switch ((exit_code = parse_builtin(count, cmd_argv))) {
-                case 0x1337:
-                    exit_code = spawnwait(cmd_argv);
-                    break;
-                case 0xDEAD:
-                    running = 0;
-                    break;
-                case 0x1:
-                case 0x0:
-                    break;
-                case 0xAA:
-                    fprintf(stderr, "%s: wrong number of arguments!\n", cmd_argv[0]);
-                    break;
-                default:
-                    if ((exit_code & 0xFFFF) == 0xDEAD) {
-                        return (exit_code >> 16);
-                    } else {
-                        fprintf(stderr, "error: parse_builtin returned an unknown action identifier (%hd)\n", exit_code);
-                    }
-                    break;
-            }
+        if (runcommand(cmd_argv, argc, commands[cmd].background, command_text, arena) == -1 || exit_requested)
+            break;
+    }
 
-            // put exit code into env
-            snprintf(exit_str, 19, "%d", exit_code);
-            setenv("?", exit_str, 1);
+    return exit_requested ? last_status : -1;
+}
 
-            if (exit_expect == 0 && exit_code != 0)
-                exit_expect_satisfy = 2;
-            else if (exit_expect == 1 && exit_code == 0)
-                exit_expect_satisfy = 3;
-            else
-                exit_expect_satisfy = 0;
+/**
+ * runs one parsed command and keeps track of where its
+ * time went. a leading time prints that when it's done,
+ * with CBSH_TRACEFD set, it's written as a JSON line.
+ * returns what runparsed returns.
+**/
+int runcommand(char **cmd_argv, int count, int background, const char *command_text, struct arena *arena) {
+    struct command_trace cmdtrace = { trace_parse, 0, 0, 0, 0, 0, 0, trace };
+    struct rusage before, after;
+    struct timespec start;
+    long long started = nowns(), total;
+    int status = 0x0, timed = 0;
+
+    trace_parse = 0;
+    trace = &cmdtrace;
+    if (trace_fd != -1)
+        clock_gettime(CLOCK_REALTIME, &start);
+
+    /* time is a keyword, it times the whole pipeline */
+    if (!strcmp(cmd_argv[0], "time")) {
+        timed = 1;
+        cmd_argv++;
+        count--;
+        getrusage(RUSAGE_SELF, &before);
+    }
 
-#ifdef DEBUG_OUTPUT
-            printf("program exited with exit code %d\n", exit_code);
-#endif
+    if (count > 0)
+        status = runparsed(cmd_argv, count, background, command_text, arena);
 
-            /* if a command created a file, take note of that */
-            buildhints(".");
+    total = nowns() - started;
+    trace = cmdtrace.outer;
 
-            /* free stuff */
-            free(cmd_argv);
-        }
+    /* the outer command started and waited for this one's children too */
+    if (trace) {
+        trace->spawn += cmdtrace.spawn;
+        trace->wait += cmdtrace.wait;
+        trace->utime += cmdtrace.utime;
+        trace->stime += cmdtrace.stime;
+        if (cmdtrace.maxrss > trace->maxrss)
+            trace->maxrss = cmdtrace.maxrss;
+    }
 
-        /* free stuff that is no longer used */
-        free(command);
+    if (timed) {
+        char real[24], user[24], sys[24];
+
+        getrusage(RUSAGE_SELF, &after);
+        formattime(real, sizeof(real), total / 1000);
+        formattime(user, sizeof(user), cmdtrace.utime + (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000LL
+                                                      + (after.ru_utime.tv_usec - before.ru_utime.tv_usec));
+        formattime(sys, sizeof(sys), cmdtrace.stime + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL
+                                                    + (after.ru_stime.tv_usec - before.ru_stime.tv_usec));
+        fprintf(stderr, "\nreal\t%s\nuser\t%s\nsys\t%s\n", real, user, sys);
     }
 
-    return 0;
+    if (trace_fd != -1)
+        writetrace(&cmdtrace, command_text, status == -1 ? last_status : status, &start, total);
+
+    return status;
+}
+
+/* monotonic time in ns, for measuring how long things took */
+long long nowns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* formats us microseconds like 0m0.123s */
+void formattime(char *buf, size_t len, long long us) {
+    if (us < 0)
+        us = 0;
+    snprintf(buf, len, "%lldm%lld.%03llds", us / 60000000, us / 1000000 % 60, us / 1000 % 1000);
 }
 
 /**
- * parses a builtin function
- * returns 0x1337 if no builtin function
- * with the specified name was found
- * returns 0xDEAD for exit
- * returns 0x0 or 0x1 to specify success or failure
- * returns 0xAA if command usage is wrong
- * returns 0xBA to shift args and re-parse
+ * writes one trace record for a command to trace_fd
+ * one line of JSON, written at once, so shells sharing
+ * a file opened with O_APPEND don't mix up their lines.
 **/
-int parse_builtin(int argc, char *const argv[]) {
-    if (!strcmp(argv[0], "exit") || !strcmp(argv[0], "logout")) {
-        if (argc == 1) {
-            return 0xDEAD;
-        } else if (argc == 2) {
-            return 0xDEAD | (atoi(argv[1]) << 16);
-        }
-        return 0xAA;
-    } else if (!strcmp(argv[0], "cd") || !strcmp(argv[0], "chdir")) {
-        if (argc == 1) {
-            chdir(homedir);
-            strcpy(curdir, homedir);
-            setenv("PWD", curdir, 1);
-            return 0x0;
-        } else if (argc == 2) {
-            if (chdir(argv[1])) {
-                perror("chdir");
-                return 0x1;
-            }
-            getcwd(curdir, MAXCURDIRLEN);
-            setenv("PWD", curdir, 1);
-            return 0x0;
-        }
-        return 0xAA;
-    } else if (!strcmp(argv[0], "export") || !strcmp(argv[0], "setenv")) {
-        if (argc == 1) {
-            return 0xAA;
-        }
+void writetrace(const struct command_trace *cmdtrace, const char *command_text, int status, const struct timespec *start, long long total) {
+    char record[1024], command[512];
+    long long dispatch = total - cmdtrace->alias - cmdtrace->spawn - cmdtrace->wait;
+    int len;
+
+    jsonescape(command, sizeof(command), command_text);
+    len = snprintf(record, sizeof(record),
+                   "{\"pid\":%d,\"seq\":%lu,\"depth\":%d,\"start\":%lld.%06ld,\"command\":\"%s\",\"status\":%d,"
+                   "\"parse_us\":%lld,\"alias_us\":%lld,\"dispatch_us\":%lld,\"spawn_us\":%lld,\"wait_us\":%lld,\"total_us\":%lld,"
+                   "\"utime_us\":%lld,\"stime_us\":%lld,\"maxrss_kb\":%ld}\n",
+                   (int) getpid(), ++trace_seq, function_depth, (long long) start->tv_sec, start->tv_nsec / 1000, command, status,
+                   cmdtrace->parse / 1000, cmdtrace->alias / 1000, (dispatch > 0 ? dispatch : 0) / 1000, cmdtrace->spawn / 1000,
+                   cmdtrace->wait / 1000, total / 1000, cmdtrace->utime, cmdtrace->stime, cmdtrace->maxrss);
+
+    if (len > 0 && (size_t) len < sizeof(record))
+        write(trace_fd, record, len);
+}
 
-        int varidx;
-        for (varidx = 1; varidx < argc; varidx++) {
-            char *key = malloc(sizeof(char) * 64), *value = malloc(sizeof(char) * 1024);
-            if (sscanf(argv[varidx], "%63[^=]=%1023[^\n]", key, value) == 2) {
-                setenv(key, value, 1);
-                free(key);
-                free(value);
-            } else {
-                free(key);
-                free(value);
-                return 0xAA;
-            }
-        }
-        return 0x0;
-    } else if (haschar(argv[0], '=')) {
-        char *key = malloc(sizeof(char) * 64), *value = malloc(sizeof(char) * 1024);
-        if (sscanf(argv[0], "%63[^=]=%1023[^\n]", key, value) == 2) {
-            setenv(key, value, 1);
-            free(key);
-            free(value);
+/**
+ * copies str into out as the inside of a JSON string
+ * what doesn't fit is cut off, never in the middle of an escape.
+ * returns the length of out.
+**/
+size_t jsonescape(char *out, size_t outlen, const char *str) {
+    size_t pos = 0;
+    const unsigned char *src;
 
-            /* if there were arguments left, run the command after all var declarations */
-            if (argc == 1) {
-                return 0x0;
-            } else {
-                return 0xBA;
-            }
+    for (src = (const unsigned char *) str; *src != '\0'; src++) {
+        if (*src == '"' || *src == '\\') {
+            if (pos + 3 > outlen)
+                break;
+            out[pos++] = '\\';
+            out[pos++] = *src;
+        } else if (*src < 0x20) {
+            if (pos + 7 > outlen)
+                break;
+            pos += sprintf(out + pos, "\\u%04x", *src);
         } else {
-            free(key);
-            free(value);
-        }
-        return 0xAA;
-    } else if (!strcmp(argv[0], "getenv")) {
-        if (argc == 2) {
-            char *envvar = getenv(argv[1]);
-            if (envvar) {
-                printf("%s\n", envvar);
-                return 0x0;
-            } else {
-                printf("error: getenv: no such variable\n");
-                return 0x1;
-            }
-        }
-        return 0xAA;
-    } else if (!strcmp(argv[0], "builtin")) {
-        if (argc >= 2) {
-            return parse_builtin(argc - 1, argv + 1);
-        }
-        return 0xAA;
-    } else if (!strcmp(argv[0], "command")) {
-        if (argc == 1) {
-            return 0xAA;
+            if (pos + 2 > outlen)
+                break;
+            out[pos++] = *src;
         }
+    }
 
-        int option;
-        char *pathent, *pathold;
-        while ((option = getopt(argc, argv, "pVv")) != -1) {
-            switch (option) {
-                case 'p':
-                    if (argc == 1) {
-                        return 0xAA;
-                    }
+    out[pos] = '\0';
+    return pos;
+}
 
-                    pathent = strdup("PATH=/usr/local/bin:/usr/bin:/bin:/usr/sbin:/sbin");
-                    pathold = strdup(getenv("PATH"));
-                    putenv(pathent);
-                    spawnwait(argv + 2);
-                    setenv("PATH", pathold, 1);
-                    free(pathent);
-                    free(pathold);
-                    return 0x0;
-                case 'v':
-                case 'V':
-                case '?':
-                    return 0xAA;
-            }
-        }
+/**
+ * runs one parsed command: splits it into pipeline stages,
+ * expands aliases and calls the function, builtin or binary.
+ * cmd_argv holds count words, NULL marks each |.
+ * returns the exit code, or -1 if the rest of the line has
+ * to be skipped. exit sets exit_requested.
+**/
+int runparsed(char **cmd_argv, int count, int background, const char *command_text, struct arena *arena) {
+    struct shell_function *function;
+    long long started = nowns();
+    int i;
 
-        spawnwait(argv + 1);
-        return 0x0;
-    } else if (!strcmp(argv[0], "echo")) {
-        int putnewline = 1, current = 1;
+    cmd_argv[count] = NULL;
 
-        if (argc > 1) {
-            if (!strcmp(argv[1], "-e")) {
-                putnewline = 0;
-                current++;
-            }
-        }
+    /* aliases go first, the | they bring split stages like any other */
+    expandalias(&cmd_argv, &count, arena);
 
-        for (; current < argc; current++) {
-            int argl = strlen(argv[current]), cchar = 0;
-            for (; cchar < argl; cchar++) {
-                putchar(argv[current][cchar]);
-            }
+    /* split into pipeline stages at the markers dtmparse left for | */
+    int nstages = 1, stage = 0, start = 0;
+    for (i = 0; i < count; i++) {
+        if (cmd_argv[i] == NULL)
+            nstages++;
+    }
 
-            if (current != argc - 1) {
-                putchar(' ');
+    struct pipe_stage *stages = arena_alloc(arena, sizeof(struct pipe_stage) * nstages);
+    for (i = 0; i <= count; i++) {
+        if (i == count || cmd_argv[i] == NULL) {
+            stages[stage].argv = cmd_argv + start;
+            stages[stage].argc = i - start;
+            stages[stage].redirs = NULL;
+            stages[stage].redir_c = 0;
+            stages[stage].assigns = NULL;
+            stages[stage].assign_c = 0;
+            start = i + 1;
+
+            /* take out redirections and NAME=value words */
+            if (splitredirs(&stages[stage], arena) == -1)
+                return -1;
+            if (stages[stage].argc > 0)
+                splitassigns(&stages[stage]);
+
+            if (stages[stage].argc == 0) {
+                break;
             }
+            stage++;
         }
-        if (putnewline) {
-            putchar('\n');
-        }
-
-        return 0x0;
-    } else if (!strcmp(argv[0], ":")) {
-        return 0x0;
-    } else if (!strcmp(argv[0], ".") || !strcmp(argv[0], "source")) {
-        return 0x0;
-    } else if (!strcmp(argv[0], "alias")) {
-        if (argc == 1) {
-            unsigned int i;
+    }
 
-            for (i = 0; aliases[i] != NULL; i++) {
-                printf("alias %s='%s'\n", aliases[i]->alias, aliases[i]->command);
-            }
+    trace->alias = nowns() - started;
 
-            return 0x0;
-        }
+    /* only redirections, the files are still created */
+    if (nstages == 1 && stage == 0 && stages[0].redir_c > 0) {
+        if (openredirs(&stages[0]) == -1)
+            return 0x1;
+        closeredirs(&stages[0]);
+        return 0x0;
+    }
 
-        /* fix memory */
-        aliases = realloc(aliases, sizeof(struct command_alias *) * (alias_c + argc));
+    if (stage != nstages) {
+        panic("syntax error", "empty command in pipeline\n");
+        return -1;
+    }
 
-        int varidx;
-        for (varidx = 1; varidx < argc; varidx++) {
-            char *key = malloc(sizeof(char) * 128), *value = malloc(sizeof(char) * 2048);
-            if (sscanf(argv[varidx], "%127[^=]=%2047[^\n]", key, value) == 2) {
-                aliases[alias_c] = malloc(sizeof(struct command_alias));
+    cmd_argv = stages[0].argv;
+    count = stages[0].argc;
 
-                aliases[alias_c]->alias = key;
-                aliases[alias_c]->command = value;
+#ifdef DEBUG_OUTPUT
+    fprintf(stderr, "parsed command: ");
+    for (stage = 0; stage < nstages; stage++) {
+        if (stage)
+            fprintf(stderr, " | ");
+        for (i = 0; i < stages[stage].argc; i++) {
+            fprintf(stderr, "[%s]", stages[stage].argv[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+    fflush(stdout);
+#endif
 
-                alias_c++;
+    /* run command, builtins and functions get redirected in-process */
+    struct var_overlay overlay = { stages[0].assigns, stages[0].assign_c, var_overlay };
+    int exit_code = 0, *saved_fds = NULL;
+    if (nstages == 1 && !background && stages[0].redir_c > 0 && isbuiltin(cmd_argv[0]))
+        saved_fds = arena_alloc(arena, sizeof(int) * stages[0].redir_c);
+
+    /* a single command sees its NAME=value words, in pipelines every stage has its own */
+    if (nstages == 1 && overlay.count)
+        var_overlay = &overlay;
+
+    if (nstages > 1 || background) {
+        exit_code = runpipeline(stages, nstages, background, command_text);
+    } else if (saved_fds && swapredirs(&stages[0], saved_fds) == -1) {
+        saved_fds = NULL;
+        exit_code = 0x1;
+    } else if ((function = findfunction(cmd_argv[0])) != NULL) {
+        exit_code = callfunction(function, count, cmd_argv, arena);
+    } else switch ((exit_code = parse_builtin(count, cmd_argv))) {
+        case 0x1337:
+            exit_code = runpipeline(stages, 1, 0, command_text);
+            break;
+        case 0xBA:
+            /* only NAME=value words, they're set one by one */
+            while (exit_code == 0xBA)
+                exit_code = builtin_assign(--count, ++cmd_argv);
+            break;
+        case 0xDEAD:
+            exit_requested = 1;
+            exit_code = last_status;
+            break;
+        case 0x1:
+        case 0x0:
+            break;
+        case 0xAA:
+            fprintf(stderr, "%s: wrong number of arguments!\n", cmd_argv[0]);
+            break;
+        default:
+            if ((exit_code & 0xFFFF) == 0xDEAD) {
+                exit_requested = 1;
+                exit_code >>= 16;
+            } else if (exit_code > 0x1 && exit_code <= 0xFF) {
+                break;
             } else {
-                free(key);
-                free(value);
-                return 0xAA;
+                fprintf(stderr, "error: parse_builtin returned an unknown action identifier (%hd)\n", exit_code);
             }
-        }
+            break;
+    }
 
-        /* add alias to command list */
-        buildcommands();
+    var_overlay = overlay.outer;
+    if (saved_fds)
+        restoreredirs(&stages[0], saved_fds);
 
-        return 0x0;
-    } else if (!strcmp(argv[0], "unalias")) {
-        return 0x0;
+    // $? is read from last_status
+    last_status = exit_code;
+
+#ifdef DEBUG_OUTPUT
+    if (nstages > 1) {
+        fprintf(stderr, "pipeline stages exited with");
+        for (stage = 0; stage < pipestatus_c; stage++) {
+            fprintf(stderr, " %d", pipestatus[stage]);
+        }
+        fprintf(stderr, "\n");
     }
-    return 0x1337;
+    fprintf(stderr, "program exited with exit code %d\n", exit_code);
+#endif
+
+    return exit_code;
 }
 
 /**
- * spawns argv, waits for it to die and
- * then returns its return value
+ * parses a builtin function
+ * returns 0x1337 if no builtin function
+ * with the specified name was found
+ * returns 0xDEAD for exit
+ * returns 0x0 or 0x1 to specify success or failure
+ * returns any other value up to 0xFF as exit status
+ * returns 0xAA if command usage is wrong
+ * returns 0xBA to shift args and re-parse
+**/
+int parse_builtin(int argc, char *const argv[]) {
+    const struct builtin *builtin = findbuiltin(argv[0]);
+
+    if (builtin != NULL)
+        return builtin->func(argc, argv);
+    if (haschar(argv[0], '='))
+        return builtin_assign(argc, argv);
+    return 0x1337;
+}
+
+/**
+ * looks up name in the builtin hash table
+ * the table is perfect (see initbuiltins), so this costs
+ * one hash and at most one strcmp, no matter how many
+ * builtins there are.
+**/
+const struct builtin *findbuiltin(const char *name) {
+    unsigned char slot = builtin_slots[strhash(name, builtin_seed) & (BUILTIN_SLOTS - 1)];
+
+    if (slot && !strcmp(builtins[slot - 1].name, name))
+        return &builtins[slot - 1];
+    return NULL;
+}
+
+/**
+ * generates the perfect hash for the builtins table:
+ * tries seeds until every builtin lands in its own slot
+**/
+void initbuiltins() {
+    unsigned int idx, slot;
+
+    for (builtin_seed = 0;; builtin_seed++) {
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+
+        for (idx = 0; idx < NUM_BUILTINS; idx++) {
+            slot = strhash(builtins[idx].name, builtin_seed) & (BUILTIN_SLOTS - 1);
+            if (builtin_slots[slot])
+                break;
+            builtin_slots[slot] = idx + 1;
+        }
+
+        if (idx == NUM_BUILTINS)
+            return;
+    }
+}
+
+/* seeded FNV-1a */
+unsigned int strhash(const char *name, unsigned int seed) {
+    unsigned int hash = 2166136261u ^ seed;
+
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+/* exit [n], logout [n] */
+int builtin_exit(int argc, char *const argv[]) {
+    if (argc == 1) {
+        return 0xDEAD;
+    } else if (argc == 2) {
+        return 0xDEAD | (atoi(argv[1]) << 16);
+    }
+    return 0xAA;
+}
+
+/* cd [dir], chdir [dir] */
+int builtin_cd(int argc, char *const argv[]) {
+    if (argc == 1) {
+        chdir(homedir);
+        strcpy(curdir, homedir);
+        setvar("PWD", curdir, 1);
+        return 0x0;
+    } else if (argc == 2) {
+        if (chdir(argv[1])) {
+            perror("chdir");
+            return 0x1;
+        }
+        getcwd(curdir, MAXCURDIRLEN);
+        setvar("PWD", curdir, 1);
+        return 0x0;
+    }
+    return 0xAA;
+}
+
+/* export NAME[=value]..., setenv NAME[=value]... */
+int builtin_export(int argc, char *const argv[]) {
+    if (argc == 1) {
+        return 0xAA;
+    }
+
+    int varidx;
+    for (varidx = 1; varidx < argc; varidx++) {
+        const char *equals = strchr(argv[varidx], '=');
+        size_t namelen = equals ? (size_t) (equals - argv[varidx]) : strlen(argv[varidx]);
+        char *key = strndup(argv[varidx], namelen);
+
+        /* without a value, the variable keeps the one it has */
+        if (!validname(key, namelen) || setvar(key, equals ? equals + 1 : NULL, 1) == -1) {
+            free(key);
+            return 0xAA;
+        }
+        free(key);
+    }
+    return 0x0;
+}
+
+/* NAME=value [command] */
+int builtin_assign(int argc, char *const argv[]) {
+    const char *equals = strchr(argv[0], '=');
+    char *key = strndup(argv[0], equals - argv[0]);
+
+    if (!validname(key, equals - argv[0]) || setvar(key, equals + 1, 0) == -1) {
+        free(key);
+        return 0xAA;
+    }
+    free(key);
+
+    /* if there were arguments left, run the command after all var declarations */
+    if (argc == 1) {
+        return 0x0;
+    } else {
+        return 0xBA;
+    }
+}
+
+/* getenv NAME */
+int builtin_getenv(int argc, char *const argv[]) {
+    if (argc == 2) {
+        const char *envvar = lookupvar(argv[1]);
+        if (envvar) {
+            printf("%s\n", envvar);
+            return 0x0;
+        } else {
+            printf("error: getenv: no such variable\n");
+            return 0x1;
+        }
+    }
+    return 0xAA;
+}
+
+/* builtin name [args] */
+int builtin_builtin(int argc, char *const argv[]) {
+    if (argc >= 2) {
+        return parse_builtin(argc - 1, argv + 1);
+    }
+    return 0xAA;
+}
+
+/* command [-p] command [args] */
+int builtin_command(int argc, char *const argv[]) {
+    if (argc == 1 || !strcmp(argv[1], "-v") || !strcmp(argv[1], "-V")) {
+        return 0xAA;
+    }
+
+    if (!strcmp(argv[1], "-p")) {
+        if (argc == 2) {
+            return 0xAA;
+        }
+
+        /* the default PATH only exists for this one command */
+        struct var_overlay overlay = { (char *[]) { "PATH=/usr/local/bin:/usr/bin:/bin:/usr/sbin:/sbin" }, 1, var_overlay };
+        int status;
+
+        var_overlay = &overlay;
+        status = spawnwait(argv + 2);
+        var_overlay = overlay.outer;
+        return status;
+    }
+
+    return spawnwait(argv + 1);
+}
+
+/* echo [-e] [args] */
+int builtin_echo(int argc, char *const argv[]) {
+    int putnewline = 1, current = 1;
+
+    if (argc > 1) {
+        if (!strcmp(argv[1], "-e")) {
+            putnewline = 0;
+            current++;
+        }
+    }
+
+    for (; current < argc; current++) {
+        int argl = strlen(argv[current]), cchar = 0;
+        for (; cchar < argl; cchar++) {
+            putchar(argv[current][cchar]);
+        }
+
+        if (current != argc - 1) {
+            putchar(' ');
+        }
+    }
+    if (putnewline) {
+        putchar('\n');
+    }
+
+    return 0x0;
+}
+
+/* : [args] */
+int builtin_colon(int argc, char *const argv[]) {
+    (void) argc;
+    (void) argv;
+    return 0x0;
+}
+
+/* . file, source file */
+int builtin_source(int argc, char *const argv[]) {
+    if (argc != 2) {
+        return 0xAA;
+    }
+
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(argv[1]);
+        return 0x1;
+    }
+
+    /* the current line is still in use, so the sourced file gets its own arena */
+    struct input_source input;
+    struct arena arena = { NULL, NULL };
+    input_open(&input, fd);
+    int status = shell_mainloop(&input, &arena);
+    input_close(&input);
+    arena_free(&arena);
+
+    if (exit_requested) {
+        return 0xDEAD | (status << 16);
+    }
+    return status;
+}
+
+/* alias [name[=command]...] */
+int builtin_alias(int argc, char *const argv[]) {
+    struct command_alias *alias;
+    int varidx, status = 0;
+
+    if (argc == 1) {
+        unsigned int bucket;
+
+        for (bucket = 0; bucket < ALIAS_BUCKETS; bucket++) {
+            for (alias = alias_table[bucket]; alias; alias = alias->next) {
+                printf("alias %s='%s'\n", alias->alias, alias->command);
+            }
+        }
+
+        return 0x0;
+    }
+
+    for (varidx = 1; varidx < argc; varidx++) {
+        char *value = strchr(argv[varidx], '=');
+
+        if (value == argv[varidx] || (value && value[1] == '\0'))
+            return 0xAA;
+
+        if (value) {
+            *value = '\0';
+            setalias(argv[varidx], value + 1);
+            *value = '=';
+        } else if ((alias = findalias(argv[varidx])) != NULL) {
+            printf("alias %s='%s'\n", alias->alias, alias->command);
+        } else {
+            fprintf(stderr, "alias: %s: not found\n", argv[varidx]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+/* unalias -a | unalias name... */
+int builtin_unalias(int argc, char *const argv[]) {
+    int varidx, status = 0;
+
+    if (argc == 1)
+        return 0xAA;
+
+    if (argc == 2 && !strcmp(argv[1], "-a")) {
+        unsigned int bucket;
+
+        for (bucket = 0; bucket < ALIAS_BUCKETS; bucket++) {
+            while (alias_table[bucket]) {
+                removealias(alias_table[bucket]->alias);
+            }
+        }
+
+        return 0x0;
+    }
+
+    for (varidx = 1; varidx < argc; varidx++) {
+        if (removealias(argv[varidx]) == -1) {
+            fprintf(stderr, "unalias: %s: not found\n", argv[varidx]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+/* jobs */
+int builtin_jobs(int argc, char *const argv[]) {
+    int jobidx;
+
+    (void) argc;
+    (void) argv;
+    reapchildren();
+    for (jobidx = 0; jobidx < job_c; jobidx++) {
+        if (jobs[jobidx] == NULL || !jobs[jobidx]->background)
+            continue;
+
+        printjob(jobs[jobidx]);
+        if (jobstate(jobs[jobidx]) == JOB_DONE) {
+            removejob(jobs[jobidx]);
+        } else {
+            jobs[jobidx]->notify = 0;
+        }
+    }
+    return 0x0;
+}
+
+/* fg [%n], bg [%n] */
+int builtin_fg(int argc, char *const argv[]) {
+    if (argc > 2) {
+        return 0xAA;
+    }
+
+    struct job *job = findjob(argv[1]);
+    if (job == NULL) {
+        fprintf(stderr, "%s: no such job\n", argv[0]);
+        return 0x1;
+    }
+
+    if (argv[0][0] == 'f') {
+        printf("%s\n", job->command);
+        return foreground(job, 1);
+    }
+
+    continuejob(job);
+    printf("[%d] %s &\n", job->id, job->command);
+    return 0x0;
+}
+
+/* wait [%n] */
+int builtin_wait(int argc, char *const argv[]) {
+    int status = 0, jobidx;
+
+    if (argc > 2) {
+        return 0xAA;
+    }
+
+    /* wait for one job */
+    if (argc == 2) {
+        struct job *job = findjob(argv[1]);
+        if (job == NULL) {
+            fprintf(stderr, "wait: no such job\n");
+            return 127;
+        }
+        status = waitjob(job);
+        if (jobstate(job) == JOB_DONE)
+            removejob(job);
+        return status;
+    }
+
+    /* wait for all of them */
+    for (jobidx = 0; jobidx < job_c; jobidx++) {
+        if (jobs[jobidx] != NULL && jobstate(jobs[jobidx]) != JOB_STOPPED) {
+            waitjob(jobs[jobidx]);
+            removejob(jobs[jobidx]);
+        }
+    }
+    return 0x0;
+}
+
+/* return [n] */
+int builtin_return(int argc, char *const argv[]) {
+    if (function_depth == 0) {
+        fprintf(stderr, "return: can only be used in a function\n");
+        return 0x1;
+    }
+
+    if (argc > 2)
+        return 0xAA;
+
+    function_return = 1;
+    return_status = argc == 2 ? atoi(argv[1]) & 0xFF : last_status;
+    return 0x0;
+}
+
+/* history [n] */
+int builtin_history(int argc, char *const argv[]) {
+    int idx;
+
+    if (argc > 2)
+        return 0xAA;
+
+    idx = argc == 2 ? history.count - atoi(argv[1]) : 0;
+    for (idx = idx < 0 ? 0 : idx; idx < history.count; idx++) {
+        printf("%5d  %s\n", history.base + idx + 1, history.entries[idx]);
+    }
+    return 0x0;
+}
+
+/* hash [-r] [-d name...] [-t name...] [-p path name] [name...] */
+int builtin_hash(int argc, char *const argv[]) {
+    struct command_hash *entry;
+    int idx, bucket, status = 0x0;
+
+    if (argc == 1) {
+        printf("hits\tcommand\n");
+        for (bucket = 0; bucket < HASH_BUCKETS; bucket++) {
+            for (entry = hash_table[bucket]; entry; entry = entry->next) {
+                printf("%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0x0;
+    }
+
+    if (!strcmp(argv[1], "-r")) {
+        if (argc != 2)
+            return 0xAA;
+        clearhash();
+        return 0x0;
+    } else if (!strcmp(argv[1], "-p")) {
+        if (argc != 4)
+            return 0xAA;
+        sethash(argv[3], argv[2]);
+        return 0x0;
+    } else if (!strcmp(argv[1], "-d") || !strcmp(argv[1], "-t")) {
+        if (argc == 2)
+            return 0xAA;
+        for (idx = 2; idx < argc; idx++) {
+            entry = findhash(argv[idx]);
+            if (entry == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", argv[idx]);
+                status = 0x1;
+            } else if (argv[1][1] == 't') {
+                printf("%s\n", entry->path);
+            } else {
+                forgethash(argv[idx]);
+            }
+        }
+        return status;
+    } else if (argv[1][0] == '-') {
+        return 0xAA;
+    }
+
+    /* look the names up now, builtins and functions don't go in */
+    for (idx = 1; idx < argc; idx++) {
+        if (isbuiltin(argv[idx]))
+            continue;
+        if (haschar(argv[idx], '/') || resolvehash(argv[idx]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", argv[idx]);
+            status = 0x1;
+        }
+    }
+    return status;
+}
+
+/* times */
+int builtin_times(int argc, char *const argv[]) {
+    struct rusage self, children;
+    char times[4][24];
+    (void) argv;
+
+    if (argc != 1)
+        return 0xAA;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    formattime(times[0], sizeof(times[0]), self.ru_utime.tv_sec * 1000000LL + self.ru_utime.tv_usec);
+    formattime(times[1], sizeof(times[1]), self.ru_stime.tv_sec * 1000000LL + self.ru_stime.tv_usec);
+    formattime(times[2], sizeof(times[2]), children.ru_utime.tv_sec * 1000000LL + children.ru_utime.tv_usec);
+    formattime(times[3], sizeof(times[3]), children.ru_stime.tv_sec * 1000000LL + children.ru_stime.tv_usec);
+    printf("%s %s\n%s %s\n", times[0], times[1], times[2], times[3]);
+    return 0x0;
+}
+
+/**
+ * spawns argv, waits for it to die and
+ * then returns its return value
 **/
 int spawnwait(char *const argv[]) {
-    int waitstatus;
-    pid_t chpid = fork();
-    switch (chpid) {
-        case 0:
-            execvp(argv[0], argv);
-            perror("execvp");
-            _exit(1);
-        case -1:
-            perror("fork");
+    struct pipe_stage stage = { (char **) argv, 0, NULL, 0, NULL, 0 };
+
+    while (argv[stage.argc] != NULL) {
+        stage.argc++;
+    }
+
+    return runpipeline(&stage, 1, 0, argv[0]);
+}
+
+/**
+ * runs every stage in its own child, connected by pipes
+ * all stages share one process group, which gets the terminal
+ * while they run. stages that are builtins run in their child.
+ * the pipeline becomes a job named command. foreground jobs are
+ * waited for and their status is returned, the status of every
+ * stage ends up in pipestatus. background jobs return 0 right away.
+ * single foreground commands are only spawned, builtins were
+ * checked before.
+**/
+int runpipeline(struct pipe_stage *stages, int nstages, int background, const char *command) {
+    int stage, fds[2] = { -1, -1 }, prev_read = -1;
+    long long started;
+    pid_t pgid = 0, chpid;
+    pid_t *pids = malloc(sizeof(pid_t) * nstages);
+
+    /* children would flush our buffered output again */
+    fflush(stdout);
+
+    for (stage = 0; stage < nstages; stage++) {
+        if (stage < nstages - 1 && pipe2(fds, O_CLOEXEC)) {
+            perror("pipe2");
+            break;
+        }
+
+        started = nowns();
+        chpid = launchstage(&stages[stage], prev_read, stage < nstages - 1 ? fds[1] : -1, pgid, background,
+                            (nstages > 1 || background) && isbuiltin(stages[stage].argv[0]));
+        if (trace)
+            trace->spawn += nowns() - started;
+
+        /* set the group here too, so we don't race the child */
+        if (jobcontrol && chpid > 0) {
+            if (pgid == 0)
+                pgid = chpid;
+            setpgid(chpid, pgid);
+        }
+
+        if (prev_read != -1)
+            close(prev_read);
+        if (stage < nstages - 1) {
+            close(fds[1]);
+            prev_read = fds[0];
+        }
+
+        if (chpid == -1)
+            break;
+        pids[stage] = chpid;
+    }
+
+    if (stage < nstages && prev_read != -1)
+        close(prev_read);
+
+    /* nothing could be started */
+    if (stage == 0) {
+        free(pids);
+        pipestatus_c = 0;
+        return 127;
+    }
+
+    struct job *job = addjob(pids, stage, pgid, command);
+    free(pids);
+
+    if (background) {
+        job->background = 1;
+        if (!(flags & 1 << 2))
+            printf("[%d] %d\n", job->id, job->pids[job->nprocs - 1]);
+        return 0x0;
+    }
+
+    int status = foreground(job, 0);
+
+    /* the stages after the one that failed never ran */
+    if (stage < nstages) {
+        pipestatus = realloc(pipestatus, sizeof(int) * nstages);
+        for (; stage < nstages; stage++) {
+            pipestatus[stage] = 127;
+        }
+        pipestatus_c = nstages;
+        return 127;
+    }
+    return status;
+}
+
+/**
+ * starts one pipeline stage with in/out as stdin/stdout
+ * (-1 to keep ours) in process group pgid (0 for a new one)
+ * external commands are started with posix_spawn, which doesn't
+ * have to copy our page tables like fork does. we only fork if
+ * the child has to do something spawn can't, like running a builtin.
+ * returns the child's pid or -1 if it couldn't be started
+**/
+pid_t launchstage(struct pipe_stage *stage, int in, int out, pid_t pgid, int background, int builtin) {
+    char **argv = stage->argv;
+    pid_t chpid;
+
+    /* files are opened here, so errors show up before anything runs */
+    if (openredirs(stage) == -1)
+        return -1;
+
+    /* NAME=value in front of the command are only set for it */
+    struct var_overlay overlay = { stage->assigns, stage->assign_c, var_overlay };
+    if (overlay.count)
+        var_overlay = &overlay;
+    char **envp = childenv();
+
+    /* look up where the binary is once instead of letting execvp walk PATH every time */
+    char execpath[MAXCURDIRLEN];
+    const char *path = NULL;
+    struct command_hash *hashed = NULL;
+    int ownpath = overlayvalue("PATH") != NULL;
+    if (!haschar(argv[0], '/') && (!builtin || !isbuiltin(argv[0]))) {
+        if (ownpath) {
+            /* a PATH just for this command doesn't go in the hash table */
+            if (searchpath(argv[0], execpath, MAXCURDIRLEN))
+                path = execpath;
+        } else if ((hashed = resolvehash(argv[0])) != NULL) {
+            hashed->hits++;
+            path = hashed->path;
+        }
+    }
+
+    /* the first stage has to take the terminal before it runs, that needs spawn support */
+#ifndef HAVE_SPAWN_TCSETPGRP
+    if (jobcontrol && pgid == 0 && !background)
+        builtin = 1;
+#endif
+
+    if (!builtin) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t sigdefault;
+        int err;
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+
+        /* hook up the pipes, the originals are closed on exec */
+        if (in != -1)
+            posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+        if (out != -1)
+            posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+        /* redirections come after the pipes, so 2>&1 | works */
+        for (int idx = 0; idx < stage->redir_c; idx++) {
+            const struct redirect *redir = &stage->redirs[idx];
+            if (redir->type == REDIR_CLOSE)
+                posix_spawn_file_actions_addclose(&actions, redir->fd);
+            else
+                posix_spawn_file_actions_adddup2(&actions, redir->type == REDIR_DUP ? redir->dupfd : redir->src, redir->fd);
+        }
+
+        /* undo everything we ignore */
+        sigemptyset(&sigdefault);
+        sigaddset(&sigdefault, SIGINT);
+        sigaddset(&sigdefault, SIGTTOU);
+        sigaddset(&sigdefault, SIGTTIN);
+        sigaddset(&sigdefault, SIGTSTP);
+        sigaddset(&sigdefault, SIGCHLD);
+        posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+        if (jobcontrol) {
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attr, pgid);
+#ifdef HAVE_SPAWN_TCSETPGRP
+            if (pgid == 0 && !background)
+                posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+        } else {
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+        }
+
+        err = ENOENT;
+        if (path) {
+            err = posix_spawn(&chpid, path, &actions, &attr, argv, envp);
+
+            /* if the binary moved, forget where it was and look again */
+            if (err == ENOENT && hashed) {
+                forgethash(argv[0]);
+                if ((hashed = resolvehash(argv[0])) != NULL) {
+                    hashed->hits++;
+                    err = posix_spawn(&chpid, hashed->path, &actions, &attr, argv, envp);
+                }
+            }
+        } else if (!ownpath || haschar(argv[0], '/')) {
+            err = posix_spawnp(&chpid, argv[0], &actions, &attr, argv, envp);
+        }
+
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        closeredirs(stage);
+        if (envp != var_envp)
+            free(envp);
+        var_overlay = overlay.outer;
+
+        if (err) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
             return -1;
-        default:
-            signal(SIGINT, SIG_IGN);
-            waitpid(chpid, &waitstatus, WUNTRACED);
-            signal(SIGINT, SIG_DFL);
-            return WEXITSTATUS(waitstatus);
+        }
+
+        launches_spawn++;
+#ifdef DEBUG_OUTPUT
+        fprintf(stderr, "launched %s with posix_spawn\n", argv[0]);
+#endif
+        return chpid;
+    }
+
+    /* the child would flush our buffered output again */
+    fflush(stdout);
+
+    chpid = fork();
+    switch (chpid) {
+        case 0:
+            if (jobcontrol) {
+                setpgid(0, pgid);
+                if (pgid == 0 && !background)
+                    tcsetpgrp(STDIN_FILENO, getpgrp());
+                signal(SIGTTOU, SIG_DFL);
+                signal(SIGTTIN, SIG_DFL);
+                signal(SIGTSTP, SIG_DFL);
+            }
+            signal(SIGCHLD, SIG_DFL);
+
+            /* hook up the pipes, the originals are closed on exec */
+            if (in != -1)
+                dup2(in, STDIN_FILENO);
+            if (out != -1)
+                dup2(out, STDOUT_FILENO);
+            if (applyredirs(stage) == -1)
+                _exit(1);
+
+            if (builtin) {
+                struct shell_function *function = findfunction(argv[0]);
+                int status;
+
+                if (function) {
+                    /* nested pipelines mustn't fight over the terminal */
+                    jobcontrol = 0;
+                    resetsigchld();
+                    status = callfunction(function, stage->argc, argv, &line_arena);
+                } else {
+                    status = parse_builtin(stage->argc, argv);
+                    while (status == 0xBA)
+                        status = builtin_assign(--stage->argc, ++argv);
+                }
+                if (status != 0x1337) {
+                    fflush(stdout);
+                    _exit((status & 0xFFFF) == 0xDEAD ? status >> 16 : status & 0xFF);
+                }
+            }
+
+            /* if the binary moved, fall back to the PATH walk */
+            if (path)
+                execve(path, argv, envp);
+            execvpe(argv[0], argv, envp);
+            perror("execvp");
+            _exit(1);
+        case -1:
+            perror("fork");
+            break;
+    }
+
+    closeredirs(stage);
+    if (envp != var_envp)
+        free(envp);
+    var_overlay = overlay.outer;
+    if (chpid == -1)
+        return -1;
+
+    launches_fork++;
+#ifdef DEBUG_OUTPUT
+    fprintf(stderr, "launched %s with fork\n", argv[0]);
+#endif
+    return chpid;
+}
+
+/* checks if name would be run by parse_builtin or callfunction */
+int isbuiltin(const char *name) {
+    /* variable assignments and functions are builtins too */
+    return findbuiltin(name) != NULL || findfunction(name) != NULL || haschar(name, '=');
+}
+
+/* converts a status from waitpid into an exit code */
+int waitstatus_code(int waitstatus) {
+    if (WIFEXITED(waitstatus))
+        return WEXITSTATUS(waitstatus);
+    if (WIFSIGNALED(waitstatus))
+        return 128 + WTERMSIG(waitstatus);
+    if (WIFSTOPPED(waitstatus))
+        return 128 + WSTOPSIG(waitstatus);
+    return 0;
+}
+
+/**
+ * adds a job for the nprocs children in pids
+ * jobs get the lowest free number, starting at 1
+**/
+struct job *addjob(pid_t *pids, int nprocs, pid_t pgid, const char *command) {
+    int slot, idx;
+    size_t len;
+
+    for (slot = 0; slot < job_c && jobs[slot] != NULL; slot++);
+    if (slot == job_c) {
+        jobs = realloc(jobs, sizeof(struct job *) * ++job_c);
+    }
+
+    struct job *job = malloc(sizeof(struct job));
+    job->id = slot + 1;
+    job->pgid = pgid;
+    job->nprocs = nprocs;
+    job->pids = malloc(sizeof(pid_t) * nprocs);
+    job->status = malloc(sizeof(int) * nprocs);
+    job->procstate = malloc(sizeof(char) * nprocs);
+    job->background = 0;
+    job->notify = 0;
+    job->utime = 0;
+    job->stime = 0;
+    job->maxrss = 0;
+
+    for (idx = 0; idx < nprocs; idx++) {
+        job->pids[idx] = pids[idx];
+        job->status[idx] = 0;
+        job->procstate[idx] = PROC_RUNNING;
+    }
+
+    /* no trailing spaces in jobs output */
+    for (len = strlen(command); len > 0 && (command[len - 1] == ' ' || command[len - 1] == '\t'); len--);
+    job->command = strndup(command, len);
+
+    jobs[slot] = job;
+    return job;
+}
+
+/* removes job from the job table */
+void removejob(struct job *job) {
+    jobs[job->id - 1] = NULL;
+
+    /* shrink the table if the job was the last one */
+    while (job_c > 0 && jobs[job_c - 1] == NULL) {
+        job_c--;
+    }
+
+    free(job->pids);
+    free(job->status);
+    free(job->procstate);
+    free(job->command);
+    free(job);
+}
+
+/**
+ * returns JOB_DONE if all processes are done, JOB_RUNNING
+ * if any of them still runs and JOB_STOPPED otherwise
+**/
+int jobstate(const struct job *job) {
+    int idx, done = 0;
+
+    for (idx = 0; idx < job->nprocs; idx++) {
+        if (job->procstate[idx] == PROC_RUNNING)
+            return JOB_RUNNING;
+        done += job->procstate[idx] == PROC_DONE;
+    }
+
+    return done == job->nprocs ? JOB_DONE : JOB_STOPPED;
+}
+
+/**
+ * finds the job spec refers to (%n or n)
+ * if spec is NULL, the newest job is used
+**/
+struct job *findjob(const char *spec) {
+    int jobidx;
+
+    if (spec == NULL) {
+        for (jobidx = job_c - 1; jobidx >= 0; jobidx--) {
+            if (jobs[jobidx] != NULL)
+                return jobs[jobidx];
+        }
+        return NULL;
+    }
+
+    if (spec[0] == '%')
+        spec++;
+
+    jobidx = atoi(spec) - 1;
+    if (jobidx < 0 || jobidx >= job_c)
+        return NULL;
+    return jobs[jobidx];
+}
+
+/* prints a line about job for the jobs builtin and notifications */
+void printjob(const struct job *job) {
+    int state = jobstate(job), status = job->status[job->nprocs - 1];
+
+    if (state == JOB_RUNNING) {
+        printf("[%d]  Running\t\t%s &\n", job->id, job->command);
+    } else if (state == JOB_STOPPED) {
+        printf("[%d]  Stopped\t\t%s\n", job->id, job->command);
+    } else if (status == 0) {
+        printf("[%d]  Done\t\t%s\n", job->id, job->command);
+    } else {
+        printf("[%d]  Exit %d\t\t%s\n", job->id, status, job->command);
+    }
+}
+
+/**
+ * collects the state of every child that changed
+ * SIGCHLD only writes to the self-pipe, which is drained
+ * before asking for the children, so no change is missed.
+**/
+void reapchildren() {
+    struct rusage usage;
+    char buf[64];
+    pid_t pid;
+    int waitstatus, jobidx, idx;
+
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+
+    while ((pid = wait4(-1, &waitstatus, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        for (jobidx = 0; jobidx < job_c; jobidx++) {
+            struct job *job = jobs[jobidx];
+            if (job == NULL)
+                continue;
+
+            for (idx = 0; idx < job->nprocs && job->pids[idx] != pid; idx++);
+            if (idx == job->nprocs)
+                continue;
+
+            if (WIFCONTINUED(waitstatus)) {
+                job->procstate[idx] = PROC_RUNNING;
+            } else {
+                job->procstate[idx] = WIFSTOPPED(waitstatus) ? PROC_STOPPED : PROC_DONE;
+                job->status[idx] = waitstatus_code(waitstatus);
+                if (!WIFSTOPPED(waitstatus)) {
+                    job->utime += usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+                    job->stime += usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+                    if (usage.ru_maxrss > job->maxrss)
+                        job->maxrss = usage.ru_maxrss;
+                }
+                job->notify = job->background && jobstate(job) != JOB_RUNNING;
+            }
+            break;
+        }
+    }
+}
+
+/* waits until job is done or stopped and returns its status */
+int waitjob(struct job *job) {
+    struct pollfd pfd = { sigchld_pipe[0], POLLIN, 0 };
+
+    reapchildren();
+    while (jobstate(job) == JOB_RUNNING) {
+        poll(&pfd, 1, -1);
+        reapchildren();
+    }
+
+    return job->status[job->nprocs - 1];
+}
+
+/* lets a stopped job run again */
+void continuejob(struct job *job) {
+    int idx;
+
+    for (idx = 0; idx < job->nprocs; idx++) {
+        if (job->procstate[idx] == PROC_STOPPED)
+            job->procstate[idx] = PROC_RUNNING;
+    }
+
+    if (job->pgid) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (idx = 0; idx < job->nprocs; idx++) {
+            kill(job->pids[idx], SIGCONT);
+        }
+    }
+}
+
+/**
+ * gives job the terminal and waits for it
+ * if cont is set, the job is continued first.
+ * done jobs are removed, stopped ones stay in the job table
+ * as background jobs. returns the status of the job.
+**/
+int foreground(struct job *job, int cont) {
+    int status;
+
+    job->background = 0;
+    if (jobcontrol && job->pgid)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    if (cont)
+        continuejob(job);
+
+    long long started = nowns();
+    signal(SIGINT, SIG_IGN);
+    status = waitjob(job);
+    signal(SIGINT, SIG_DFL);
+    if (trace)
+        trace->wait += nowns() - started;
+
+    if (jobcontrol)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+
+    if (jobstate(job) == JOB_STOPPED) {
+        job->background = 1;
+        printf("\n");
+        printjob(job);
+        return status;
+    }
+
+    pipestatus = realloc(pipestatus, sizeof(int) * job->nprocs);
+    memcpy(pipestatus, job->status, sizeof(int) * job->nprocs);
+    pipestatus_c = job->nprocs;
+
+    if (trace) {
+        trace->utime += job->utime;
+        trace->stime += job->stime;
+        if (job->maxrss > trace->maxrss)
+            trace->maxrss = job->maxrss;
+    }
+
+    removejob(job);
+    return status;
+}
+
+/**
+ * collects finished children and, if interactive,
+ * tells the user about background jobs that finished
+ * or stopped since the last prompt
+**/
+void notifyjobs(int interactive) {
+    int jobidx;
+
+    reapchildren();
+    if (!interactive)
+        return;
+
+    for (jobidx = 0; jobidx < job_c; jobidx++) {
+        if (jobs[jobidx] == NULL || !jobs[jobidx]->notify)
+            continue;
+
+        printjob(jobs[jobidx]);
+        jobs[jobidx]->notify = 0;
+        if (jobstate(jobs[jobidx]) == JOB_DONE)
+            removejob(jobs[jobidx]);
+    }
+}
+
+/* SIGCHLD handler, only wakes up whoever waits on the self-pipe */
+void sigchld_handler(int sig) {
+    int saved_errno = errno;
+
+    (void) sig;
+    if (write(sigchld_pipe[1], "", 1)) {}
+
+    errno = saved_errno;
+}
+
+/* gives a forked copy of the shell its own self-pipe, a shared one would steal wakeups */
+void resetsigchld() {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK);
+}
+
+/**
+ * moves the NAME=value words in front of the command out of
+ * the stage's argv, they're only set for that command. if
+ * nothing comes after them, they're plain assignments and
+ * stay where they are.
+ * returns how many words were assignments.
+**/
+int splitassigns(struct pipe_stage *stage) {
+    const char *equals;
+    int count;
+
+    for (count = 0; count < stage->argc; count++) {
+        if ((equals = strchr(stage->argv[count], '=')) == NULL || !validname(stage->argv[count], equals - stage->argv[count]))
+            break;
+    }
+
+    if (count > 0 && count < stage->argc) {
+        stage->assigns = stage->argv;
+        stage->assign_c = count;
+        stage->argv += count;
+        stage->argc -= count;
+    }
+    return count;
+}
+
+/**
+ * moves the redirection operators dtmparse marked (and their
+ * targets) out of the stage's argv into its redirection list.
+ * can be called again, new redirections are appended.
+ * returns -1 on syntax errors.
+**/
+int splitredirs(struct pipe_stage *stage, struct arena *arena) {
+    int idx, argc = 0, count = 0;
+
+    for (idx = 0; idx < stage->argc; idx++) {
+        count += stage->argv[idx][0] == REDIR_MARK;
+    }
+    if (count == 0)
+        return 0;
+
+    /* &> needs two entries */
+    struct redirect *redirs = arena_alloc(arena, sizeof(struct redirect) * (stage->redir_c + count * 2));
+    if (stage->redir_c)
+        memcpy(redirs, stage->redirs, sizeof(struct redirect) * stage->redir_c);
+    stage->redirs = redirs;
+
+    char **argv = arena_alloc(arena, sizeof(char *) * (stage->argc + 1));
+    for (idx = 0; idx < stage->argc; idx++) {
+        char *op = stage->argv[idx] + 1, *target;
+        int fd = -1, both = 0;
+
+        if (stage->argv[idx][0] != REDIR_MARK) {
+            argv[argc++] = stage->argv[idx];
+            continue;
+        }
+
+        if (idx + 1 >= stage->argc || stage->argv[idx + 1][0] == REDIR_MARK) {
+            panic("syntax error", "redirection without a target\n");
+            return -1;
+        }
+        target = stage->argv[++idx];
+
+        if (*op >= '0' && *op <= '9') {
+            fd = strtol(op, &op, 10);
+        } else if (*op == '&') {
+            both = 1;
+            op++;
+        }
+
+        struct redirect *redir = &stage->redirs[stage->redir_c++];
+        redir->type = REDIR_OPEN;
+        redir->path = target;
+        redir->src = -1;
+
+        if (!strcmp(op, "<")) {
+            redir->fd = 0;
+            redir->flags = O_RDONLY;
+        } else if (!strcmp(op, "<>")) {
+            redir->fd = 0;
+            redir->flags = O_RDWR | O_CREAT;
+        } else if (!strcmp(op, ">")) {
+            redir->fd = 1;
+            redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (!strcmp(op, ">>")) {
+            redir->fd = 1;
+            redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+        } else if (!strcmp(op, "<&") || !strcmp(op, ">&")) {
+            redir->fd = op[0] == '<' ? 0 : 1;
+            if (!strcmp(target, "-")) {
+                redir->type = REDIR_CLOSE;
+            } else if (target[strspn(target, "0123456789")] == '\0') {
+                redir->type = REDIR_DUP;
+                redir->dupfd = atoi(target);
+            } else if (op[0] == '>' && fd == -1) {
+                /* >&file is &>file */
+                redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+                both = 1;
+            } else {
+                panic("syntax error", "file descriptor expected after <& or >&\n");
+                return -1;
+            }
+        } else if (!strcmp(op, "<<<")) {
+            redir->fd = 0;
+            redir->type = REDIR_DATA;
+            size_t len = strlen(target);
+            char *data = arena_alloc(arena, len + 2);
+            memcpy(data, target, len);
+            data[len] = '\n';
+            data[len + 1] = '\0';
+            redir->data = data;
+        } else if (!strcmp(op, "<<") || !strcmp(op, "<<-")) {
+            if (heredoc_next >= heredoc_c) {
+                panic("syntax error", "here-document without a body\n");
+                return -1;
+            }
+            redir->fd = 0;
+            redir->type = REDIR_DATA;
+            redir->data = heredocs[heredoc_next++];
+        } else {
+            panic("syntax error", "unknown redirection operator\n");
+            return -1;
+        }
+
+        if (fd != -1)
+            redir->fd = fd;
+
+        if (both) {
+            struct redirect *dup = &stage->redirs[stage->redir_c++];
+            dup->fd = 2;
+            dup->type = REDIR_DUP;
+            dup->dupfd = redir->fd;
+            dup->src = -1;
+        }
+    }
+
+    argv[argc] = NULL;
+    stage->argv = argv;
+    stage->argc = argc;
+    return 0;
+}
+
+/**
+ * opens the files and here-documents of stage with O_CLOEXEC,
+ * so they only show up where the child dup2s them
+ * returns -1 (and reports why) if a file can't be opened
+**/
+int openredirs(struct pipe_stage *stage) {
+    int idx;
+
+    for (idx = 0; idx < stage->redir_c; idx++) {
+        struct redirect *redir = &stage->redirs[idx];
+
+        redir->src = -1;
+        if (redir->type == REDIR_OPEN) {
+            redir->src = open(redir->path, redir->flags | O_CLOEXEC, 0666);
+        } else if (redir->type == REDIR_DATA) {
+            redir->src = datafd(redir->data, strlen(redir->data));
+        } else {
+            continue;
+        }
+
+        if (redir->src == -1) {
+            fprintf(stderr, "%s: %s\n", redir->type == REDIR_OPEN ? redir->path : "here-document", strerror(errno));
+            closeredirs(stage);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* closes what openredirs opened */
+void closeredirs(struct pipe_stage *stage) {
+    int idx;
+
+    for (idx = 0; idx < stage->redir_c; idx++) {
+        if (stage->redirs[idx].src != -1) {
+            close(stage->redirs[idx].src);
+            stage->redirs[idx].src = -1;
+        }
+    }
+}
+
+/* puts the redirections of stage in place, in a forked child */
+int applyredirs(const struct pipe_stage *stage) {
+    int idx;
+
+    for (idx = 0; idx < stage->redir_c; idx++) {
+        const struct redirect *redir = &stage->redirs[idx];
+        int src = redir->type == REDIR_DUP ? redir->dupfd : redir->src;
+
+        if (redir->type == REDIR_CLOSE) {
+            close(redir->fd);
+        } else if (src == redir->fd) {
+            /* dup2 to itself keeps O_CLOEXEC */
+            fcntl(src, F_SETFD, 0);
+        } else if (dup2(src, redir->fd) == -1) {
+            fprintf(stderr, "%d: %s\n", src, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * redirects the shell itself for a builtin or function
+ * the fds that get replaced are saved in saved (one per
+ * redirection) for restoreredirs. nothing is forked.
+**/
+int swapredirs(struct pipe_stage *stage, int *saved) {
+    int idx;
+
+    if (openredirs(stage) == -1)
+        return -1;
+
+    /* pending output belongs to the old fds */
+    fflush(stdout);
+    fflush(stderr);
+
+    for (idx = 0; idx < stage->redir_c; idx++) {
+        saved[idx] = fcntl(stage->redirs[idx].fd, F_DUPFD_CLOEXEC, 10);
+    }
+
+    if (applyredirs(stage) == -1) {
+        restoreredirs(stage, saved);
+        return -1;
+    }
+
+    closeredirs(stage);
+    return 0;
+}
+
+/* undoes swapredirs */
+void restoreredirs(const struct pipe_stage *stage, const int *saved) {
+    int idx;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (idx = stage->redir_c - 1; idx >= 0; idx--) {
+        if (saved[idx] != -1) {
+            dup2(saved[idx], stage->redirs[idx].fd);
+            close(saved[idx]);
+        } else {
+            close(stage->redirs[idx].fd);
+        }
+    }
+}
+
+/**
+ * returns a readable fd holding data
+ * small bodies fit into a pipe in one write, bigger ones go
+ * to a memfd, so nothing touches the disk and nobody has to
+ * feed the reader.
+**/
+int datafd(const char *data, size_t len) {
+    int fds[2], fd;
+    ssize_t written;
+
+    if (len <= PIPE_BUF) {
+        if (pipe2(fds, O_CLOEXEC) == -1)
+            return -1;
+        if (len > 0 && write(fds[1], data, len) != (ssize_t) len) {
+            close(fds[0]);
+            fds[0] = -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    if ((fd = memfd_create("cbsh-heredoc", MFD_CLOEXEC)) == -1)
+        return -1;
+    while (len > 0) {
+        if ((written = write(fd, data, len)) <= 0) {
+            close(fd);
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * finds the << operators of line and reads their bodies
+ * from input, one after the other, like every shell does.
+ * bodies are expanded unless the delimiter was quoted.
+**/
+void collectheredocs(struct input_source *input, const char *line, struct arena *arena) {
+    const char *pos;
+    int in_quotes = 0;
+
+    heredoc_c = heredoc_next = 0;
+
+    for (pos = line; *pos != '\0'; pos++) {
+        if (*pos == '\\' && in_quotes != 2 && pos[1] != '\0') {
+            pos++;
+            continue;
+        } else if (*pos == '"' && in_quotes != 2) {
+            in_quotes = !in_quotes;
+            continue;
+        } else if (*pos == '\'' && in_quotes != 1) {
+            in_quotes = in_quotes ? 0 : 2;
+            continue;
+        } else if (in_quotes || pos[0] != '<' || pos[1] != '<') {
+            continue;
+        } else if (pos[2] == '<') {
+            /* here-string */
+            pos += 2;
+            continue;
+        }
+
+        /* <<[-]delimiter, quotes in the delimiter turn off expansion */
+        int strip_tabs = 0, quoted = 0;
+        size_t len = 0;
+        for (pos += 2; *pos == '-'; pos++) {
+            strip_tabs = 1;
+        }
+        while (*pos == ' ' || *pos == '\t') {
+            pos++;
+        }
+
+        char *delim = arena_alloc(arena, strlen(pos) + 1);
+        for (; *pos != '\0' && !haschar(" \t;&|<>", *pos); pos++) {
+            if (*pos == '"' || *pos == '\'' || *pos == '\\') {
+                quoted = 1;
+                if (*pos != '\\' || pos[1] == '\0')
+                    continue;
+                pos++;
+            }
+            delim[len++] = *pos;
+        }
+        delim[len] = '\0';
+        pos--;
+
+        /* read up to the delimiter */
+        char *body = NULL, *bodyline;
+        size_t body_len = 0, body_alloc = 0;
+        while ((bodyline = input_readline(input, "> ", arena)) != NULL) {
+            while (strip_tabs && *bodyline == '\t') {
+                bodyline++;
+            }
+            if (!strcmp(bodyline, delim))
+                break;
+
+            size_t linelen = strlen(bodyline);
+            if (body_len + linelen + 2 > body_alloc) {
+                body_alloc = (body_len + linelen + 2) * 2;
+                body = arena_grow(arena, body, body_len, body_alloc);
+            }
+            memcpy(body + body_len, bodyline, linelen);
+            body_len += linelen;
+            body[body_len++] = '\n';
+        }
+        if (body == NULL)
+            body = arena_alloc(arena, 1);
+        body[body_len] = '\0';
+
+        heredocs = arena_grow(arena, heredoc_c ? heredocs : NULL, sizeof(char *) * heredoc_c, sizeof(char *) * (heredoc_c + 1));
+        heredocs[heredoc_c++] = quoted ? body : expandheredoc(body, arena);
+    }
+}
+
+/* expands $NAME and ${NAME} in a here-document body */
+char *expandheredoc(const char *body, struct arena *arena) {
+    size_t len = 0, alloc = strlen(body) + 1, namelen, add;
+    char *res = arena_alloc(arena, alloc), name[256];
+    const char *value, *start;
+
+    for (; *body != '\0'; body++) {
+        start = NULL;
+        namelen = 0;
+
+        if (*body == '\\' && (body[1] == '$' || body[1] == '\\')) {
+            body++;
+        } else if (*body == '$' && body[1] == '{' && strchr(body, '}') != NULL) {
+            start = body + 2;
+            namelen = strchr(body, '}') - start;
+            body = start + namelen;
+        } else if (*body == '$' && body[1] != '\0' && haschar("0123456789#@*?", body[1])) {
+            start = ++body;
+            namelen = 1;
+        } else if (*body == '$' && (isalpha((unsigned char) body[1]) || body[1] == '_')) {
+            start = body + 1;
+            while (isalnum((unsigned char) start[namelen]) || start[namelen] == '_') {
+                namelen++;
+            }
+            body += namelen;
+        }
+
+        if (start) {
+            if (namelen >= sizeof(name))
+                namelen = sizeof(name) - 1;
+            memcpy(name, start, namelen);
+            name[namelen] = '\0';
+            if ((value = lookupvar(name)) == NULL)
+                continue;
+            add = strlen(value);
+        } else {
+            value = body;
+            add = 1;
+        }
+
+        if (len + add + 1 > alloc) {
+            res = arena_grow(arena, res, alloc, (len + add + 1) * 2);
+            alloc = (len + add + 1) * 2;
+        }
+        memcpy(res + len, value, add);
+        len += add;
+    }
+
+    res[len] = '\0';
+    return res;
+}
+
+/* looks up name in the alias table */
+struct command_alias *findalias(const char *name) {
+    struct command_alias *alias;
+
+    for (alias = alias_table[strhash(name, 0) & (ALIAS_BUCKETS - 1)]; alias; alias = alias->next) {
+        if (!strcmp(alias->alias, name))
+            return alias;
+    }
+
+    return NULL;
+}
+
+/**
+ * defines (or redefines) an alias
+ * the command is tokenized once here, unless it contains
+ * expansions that have to be evaluated on every use or
+ * a |, which has to be split up with the command it's in.
+**/
+int setalias(const char *name, const char *command) {
+    struct command_alias *alias = calloc(1, sizeof(struct command_alias));
+    int idx;
+
+    alias->alias = strdup(name);
+    alias->command = strdup(command);
+
+    if (!haschar(command, '$') && !haschar(command, '`')) {
+        dtmparse(arena_strdup(&alias->tokens, command), &alias->argv, &alias->argc, &alias->tokens);
+        for (idx = 0; idx < alias->argc && alias->argv[idx] != NULL; idx++);
+        if (alias->argc == 0 || idx < alias->argc) {
+            alias->argv = NULL;
+            arena_free(&alias->tokens);
+        }
+    }
+
+    removealias(name);
+    alias->next = alias_table[strhash(name, 0) & (ALIAS_BUCKETS - 1)];
+    alias_table[strhash(name, 0) & (ALIAS_BUCKETS - 1)] = alias;
+    alias_c++;
+    alias_generation++;
+
+    return 0;
+}
+
+/* removes an alias, returns -1 if there was none */
+int removealias(const char *name) {
+    struct command_alias **link = &alias_table[strhash(name, 0) & (ALIAS_BUCKETS - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        if (!strcmp((*link)->alias, name)) {
+            struct command_alias *alias = *link;
+
+            *link = alias->next;
+            freealias(alias);
+            alias_c--;
+            alias_generation++;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void freealias(struct command_alias *alias) {
+    free(alias->alias);
+    free(alias->command);
+    free(alias->expanded);
+    arena_free(&alias->tokens);
+    free(alias);
+}
+
+/**
+ * expands alias and every alias its first word leads to.
+ * a name that already occurred in the chain is left as it
+ * is, so self-references (ls='ls -F') and mutual recursion
+ * (a='b', b='a') terminate. the result is NULL-terminated and
+ * must not be modified. chains made only of pre-tokenized
+ * aliases are memoized until the next alias change.
+**/
+char **resolvealias(struct command_alias *alias, int *count, struct arena *arena) {
+    struct command_alias *chain[ALIAS_MAXDEPTH], *next;
+    char **words, **tokens;
+    int depth = 0, words_c, tokens_c, cacheable = 1, i;
+
+    if (alias->expanded_gen == alias_generation) {
+        *count = alias->expanded_c;
+        return alias->expanded;
+    }
+
+    words = NULL;
+    words_c = 0;
+    for (next = alias; next && depth < ALIAS_MAXDEPTH; next = words_c && words[0] ? findalias(words[0]) : NULL) {
+        for (i = 0; i < depth; i++) {
+            if (chain[i] == next)
+                break;
+        }
+        if (i < depth)
+            break;
+        chain[depth++] = next;
+
+        if (next->argv) {
+            tokens = next->argv;
+            tokens_c = next->argc;
+        } else {
+            dtmparse(arena_strdup(arena, next->command), &tokens, &tokens_c, arena);
+            cacheable = 0;
+        }
+
+        /* tokens replace the first word */
+        char **joined = arena_alloc(arena, sizeof(char *) * (tokens_c + words_c + 1));
+        memcpy(joined, tokens, sizeof(char *) * tokens_c);
+        if (words_c > 1)
+            memcpy(joined + tokens_c, words + 1, sizeof(char *) * (words_c - 1));
+        words_c = tokens_c + (words_c ? words_c - 1 : 0);
+        joined[words_c] = NULL;
+        words = joined;
+    }
+
+    if (cacheable) {
+        free(alias->expanded);
+        alias->expanded = malloc(sizeof(char *) * (words_c + 1));
+        memcpy(alias->expanded, words, sizeof(char *) * (words_c + 1));
+        alias->expanded_c = words_c;
+        alias->expanded_gen = alias_generation;
+    }
+
+    *count = words_c;
+    return words;
+}
+
+/**
+ * replaces the alias at the start of every pipeline stage
+ * in argv, that's the first word that isn't a redirection
+ * or NAME=value. the alias may bring its own | and
+ * redirections, so this runs before argv is split up.
+ * argv has to be NULL-terminated at argv[*count]
+**/
+void expandalias(char ***argv, int *count, struct arena *arena) {
+    struct command_alias *alias;
+    char **expanded, **cmd_argv = *argv, **joined;
+    const char *equals;
+    int expanded_c, word = 0;
+
+    if (!alias_c)
+        return;
+
+    while (word < *count) {
+        /* find the command word of this stage */
+        for (; word < *count && cmd_argv[word] != NULL; word++) {
+            if (cmd_argv[word][0] == REDIR_MARK) {
+                if (word + 1 < *count && cmd_argv[word + 1] != NULL)
+                    word++;
+                continue;
+            }
+            if ((equals = strchr(cmd_argv[word], '=')) == NULL || !validname(cmd_argv[word], equals - cmd_argv[word]))
+                break;
+        }
+
+        if (word < *count && cmd_argv[word] != NULL && (alias = findalias(cmd_argv[word])) != NULL) {
+            expanded = resolvealias(alias, &expanded_c, arena);
+            joined = arena_alloc(arena, sizeof(char *) * (*count + expanded_c));
+            memcpy(joined, cmd_argv, sizeof(char *) * word);
+            memcpy(joined + word, expanded, sizeof(char *) * expanded_c);
+            memcpy(joined + word + expanded_c, cmd_argv + word + 1, sizeof(char *) * (*count - word));
+            *count += expanded_c - 1;
+            cmd_argv = joined;
+
+            /* what the alias brought isn't looked at again */
+            word += expanded_c;
+        }
+
+        /* on to the next stage */
+        for (; word < *count && cmd_argv[word] != NULL; word++);
+        word++;
+    }
+
+    *argv = cmd_argv;
+}
+
+/**
+ * finds the first command of line that defines a function,
+ * like f in `true; f() { ...; }`. returns where its name
+ * starts, or NULL if there's none.
+**/
+char *finddefinition(char *line) {
+    char *pos = line;
+    int in_quotes = 0, start = 1, end;
+
+    for (;;) {
+        if (start) {
+            pos += strspn(pos, " \t");
+            if (definitionname(pos))
+                return pos;
+            start = 0;
+        }
+
+        pos += strcspn(pos, in_quotes == 2 ? "'" : in_quotes == 1 ? "\\\"`$" : "\\'\"`$;&|\n#");
+
+        switch (*pos) {
+            case '\0':
+                return NULL;
+            case '\\':
+                pos += pos[1] != '\0' ? 2 : 1;
+                break;
+            case '\'':
+                in_quotes = in_quotes ? 0 : 2;
+                pos++;
+                break;
+            case '"':
+                in_quotes = !in_quotes;
+                pos++;
+                break;
+            case '`':
+            case '$':
+                if ((*pos == '`' || pos[1] == '(') && (end = substitution_end(pos, 0)) != -1)
+                    pos += end;
+                pos++;
+                break;
+            case '#':
+                /* the rest of the line is a comment */
+                if (pos == line || pos[-1] == ' ' || pos[-1] == '\t')
+                    return NULL;
+                pos++;
+                break;
+            default:
+                /* ;, &&, ||, & and | all start a new command */
+                start = *pos != '&' || pos[1] == '&' || (pos[1] != '>' && (pos == line || (pos[-1] != '>' && pos[-1] != '<')));
+                pos++;
+                break;
+        }
+    }
+}
+
+/**
+ * checks if a function definition starts at pos, name(),
+ * returns the length of its name or 0 if it doesn't
+**/
+size_t definitionname(const char *pos) {
+    const char *name = pos;
+    size_t namelen;
+
+    while ((*pos >= 'a' && *pos <= 'z') || (*pos >= 'A' && *pos <= 'Z') || (*pos >= '0' && *pos <= '9') || *pos == '_' || *pos == '-') {
+        pos++;
+    }
+    namelen = pos - name;
+    if (namelen == 0 || (name[0] >= '0' && name[0] <= '9'))
+        return 0;
+
+    while (*pos == ' ' || *pos == '\t') {
+        pos++;
+    }
+    if (*pos != '(')
+        return 0;
+    for (pos++; *pos == ' ' || *pos == '\t'; pos++);
+    return *pos == ')' ? namelen : 0;
+}
+
+/**
+ * checks if line starts a function definition, name() { ...; }
+ * if it does, the body is read up to the closing brace, asking
+ * input for more lines if needed, and compiled. returns the
+ * rest of the line after the definition, or NULL if line
+ * isn't a definition.
+**/
+char *definefunction(struct input_source *input, char *line, struct arena *arena) {
+    char *pos = line, *name, *body = NULL;
+    size_t namelen, body_len = 0, body_alloc = 0;
+    int depth = 0, in_quotes = 0;
+
+    while (*pos == ' ' || *pos == '\t' || *pos == ';') {
+        pos++;
+    }
+
+    if ((namelen = definitionname(pos)) == 0)
+        return NULL;
+    name = arena_strdup(arena, pos);
+    name[namelen] = '\0';
+    pos = strchr(pos + namelen, ')') + 1;
+    stripcomment(pos);
+
+    /* collect the body, the braces may be spread over several lines */
+    for (;;) {
+        for (; *pos != '\0'; pos++) {
+            if (depth == 0) {
+                if (*pos == ' ' || *pos == '\t')
+                    continue;
+                if (*pos != '{') {
+                    panic("syntax error", "expected { after function name\n");
+                    free(body);
+                    return "";
+                }
+                depth = 1;
+                continue;
+            }
+
+            if (body_len + 3 >= body_alloc) {
+                body_alloc = body_alloc ? body_alloc * 2 : 256;
+                body = realloc(body, sizeof(char) * body_alloc);
+            }
+
+            if (*pos == '\\' && in_quotes != 2 && pos[1] != '\0') {
+                body[body_len++] = *pos++;
+            } else if (*pos == '"' && in_quotes != 2) {
+                in_quotes = !in_quotes;
+            } else if (*pos == '\'' && in_quotes != 1) {
+                in_quotes = in_quotes ? 0 : 2;
+            } else if (!in_quotes && *pos == '{') {
+                depth++;
+            } else if (!in_quotes && *pos == '}' && --depth == 0) {
+                break;
+            }
+            body[body_len++] = *pos;
+        }
+
+        if (*pos == '}')
+            break;
+
+        if (depth > 0) {
+            if (body_len + 2 >= body_alloc) {
+                body_alloc = body_alloc ? body_alloc * 2 : 256;
+                body = realloc(body, sizeof(char) * body_alloc);
+            }
+            body[body_len++] = '\n';
+        }
+
+        if ((pos = input_readline(input, "> ", arena)) == NULL) {
+            panic("syntax error", "unexpected end of input in function definition\n");
+            free(body);
+            return "";
+        }
+        stripcomment(pos);
+    }
+
+    if (body == NULL)
+        body = malloc(sizeof(char));
+    body[body_len] = '\0';
+
+    struct shell_function *function = calloc(1, sizeof(struct shell_function)), **link;
+    function->name = arena_strdup(&function->arena, name);
+    function->refs = 1;
+    compilefunction(function, body);
+    free(body);
+
+    /* replace an older definition */
+    for (link = &function_table[strhash(name, 0) & (FUNCTION_BUCKETS - 1)]; *link; link = &(*link)->next) {
+        if (!strcmp((*link)->name, name)) {
+            struct shell_function *old = *link;
+            *link = old->next;
+            releasefunction(old);
+            function_c--;
+            break;
+        }
+    }
+    function->next = function_table[strhash(name, 0) & (FUNCTION_BUCKETS - 1)];
+    function_table[strhash(name, 0) & (FUNCTION_BUCKETS - 1)] = function;
+    function_c++;
+
+    /* whatever follows the closing brace runs as usual */
+    for (pos++; *pos == ' ' || *pos == '\t' || *pos == ';'; pos++);
+    return pos;
+}
+
+/**
+ * turns a function body into its command list
+ * the body is split at ;, newlines, &&, || and & once, and
+ * every command into words. words without expansions are
+ * unquoted right away, the rest is left for call time.
+**/
+void compilefunction(struct shell_function *function, char *body) {
+    struct arena *arena = &function->arena;
+    struct line_command *lines;
+    char *start, *word;
+    int line_c, line;
+
+    lines = splitline(body, &line_c, arena);
+    function->commands = arena_alloc(arena, sizeof(struct function_command) * (line_c + 1));
+    function->command_c = 0;
+
+    for (line = 0; line < line_c; line++) {
+        start = lines[line].text;
+
+        struct function_command *command = &function->commands[function->command_c++];
+        command->text = arena_strdup(arena, start);
+        command->op = lines[line].op;
+        command->background = lines[line].background;
+        /* every < and > may split a word into operator and target */
+        int maxwords = countchar(start, ' ') + countchar(start, '\t') + 2 * countchar(start, '|') + 2 * (countchar(start, '<') + countchar(start, '>')) + 2;
+        command->words = arena_alloc(arena, sizeof(char *) * maxwords);
+        command->expand = arena_alloc(arena, sizeof(unsigned char) * maxwords);
+        command->word_c = 0;
+
+        /* split into words, but leave quotes alone for dtmparse */
+        char *wpos = start;
+        int word_quotes = 0;
+        for (word = start;; wpos++) {
+            if (*wpos == '\\' && word_quotes != 2 && wpos[1] != '\0') {
+                wpos++;
+                continue;
+            } else if (*wpos == '"' && word_quotes != 2) {
+                word_quotes = !word_quotes;
+            } else if (*wpos == '\'' && word_quotes != 1) {
+                word_quotes = word_quotes ? 0 : 2;
+            } else if (word_quotes != 2 && ((*wpos == '$' && wpos[1] == '(') || *wpos == '`') && substitution_end(wpos, 0) != -1) {
+                wpos += substitution_end(wpos, 0);
+            } else if (!word_quotes && (*wpos == ' ' || *wpos == '\t' || *wpos == '|' || *wpos == '\0')) {
+                char end = *wpos;
+                *wpos = '\0';
+
+                if (*word != '\0' && (haschar(word, '$') || haschar(word, '`'))) {
+                    command->expand[command->word_c] = 1;
+                    command->words[command->word_c++] = arena_strdup(arena, word);
+                } else if (*word != '\0') {
+                    char **parsed = NULL;
+                    int parsed_c = 0, idx;
+                    dtmparse(arena_strdup(arena, word), &parsed, &parsed_c, arena);
+                    for (idx = 0; idx < parsed_c; idx++) {
+                        command->expand[command->word_c] = 0;
+                        command->words[command->word_c++] = parsed[idx];
+                    }
+                }
+                if (end == '|') {
+                    command->expand[command->word_c] = 0;
+                    command->words[command->word_c++] = NULL;
+                }
+                if (end == '\0')
+                    break;
+                word = wpos + 1;
+            }
+        }
+    }
+}
+
+/* looks up name in the function table */
+struct shell_function *findfunction(const char *name) {
+    struct shell_function *function;
+
+    if (!function_c)
+        return NULL;
+
+    for (function = function_table[strhash(name, 0) & (FUNCTION_BUCKETS - 1)]; function; function = function->next) {
+        if (!strcmp(function->name, name))
+            return function;
+    }
+
+    return NULL;
+}
+
+/* drops one reference, the last one frees the function */
+void releasefunction(struct shell_function *function) {
+    if (--function->refs > 0)
+        return;
+
+    arena_free(&function->arena);
+    free(function);
+}
+
+/**
+ * calls function with argv as its positional parameters
+ * only words that contain expansions are parsed here,
+ * everything else was prepared by compilefunction.
+ * returns the status of the last command that ran.
+**/
+int callfunction(struct shell_function *function, int argc, char **argv, struct arena *arena) {
+    char **saved_params = posparams;
+    int saved_param_c = posparam_c, cmd, i, count, status = 0;
+
+    if (function_depth >= FUNCTION_MAXDEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+
+    posparams = argv;
+    posparam_c = argc;
+    function_depth++;
+    function->refs++;
+
+    for (cmd = 0; cmd < function->command_c && !exit_requested && !function_return; cmd++) {
+        struct function_command *command = &function->commands[cmd];
+
+        /* && and || look at the last command that ran */
+        if ((command->op == 1 && status != 0) || (command->op == 2 && status == 0))
+            continue;
+
+        int cmd_alloc = command->word_c + 1;
+        char **cmd_argv = arena_alloc(arena, sizeof(char *) * cmd_alloc);
+        for (i = count = 0; i < command->word_c; i++) {
+            if (!command->expand[i]) {
+                cmd_argv[count++] = command->words[i];
+                continue;
+            }
+
+            char **parsed = NULL;
+            int parsed_c = 0;
+            dtmparse(arena_strdup(arena, command->words[i]), &parsed, &parsed_c, arena);
+
+            /* unquoted expansions that came up empty vanish */
+            if (parsed_c == 1 && parsed[0][0] == '\0' && !haschar(command->words[i], '"') && !haschar(command->words[i], '\''))
+                continue;
+
+            /* substitutions and redirections can make more words */
+            if (count + parsed_c + (command->word_c - i) > cmd_alloc) {
+                cmd_argv = arena_grow(arena, cmd_argv, sizeof(char *) * cmd_alloc, sizeof(char *) * (count + parsed_c + command->word_c - i));
+                cmd_alloc = count + parsed_c + command->word_c - i;
+            }
+            memcpy(cmd_argv + count, parsed, sizeof(char *) * parsed_c);
+            count += parsed_c;
+        }
+
+        if (count == 0 || cmd_argv[0] == NULL)
+            continue;
+
+        if ((status = runcommand(cmd_argv, count, command->background, command->text, arena)) == -1) {
+            status = 1;
+            break;
+        }
+    }
+
+    if (function_return) {
+        function_return = 0;
+        status = return_status;
+    }
+
+    releasefunction(function);
+    function_depth--;
+    posparams = saved_params;
+    posparam_c = saved_param_c;
+
+    return status;
+}
+
+/**
+ * looks up a variable for expansion
+ * positional parameters belong to the innermost function
+ * call, everything else comes from the environment.
+**/
+const char *lookupvar(const char *name) {
+    static char *joined = NULL, count[12];
+    static size_t joined_alloc = 0;
+    int idx;
+
+    if (name[0] >= '0' && name[0] <= '9') {
+        idx = atoi(name);
+        if (idx == 0)
+            return shell_name;
+        return idx < posparam_c ? posparams[idx] : NULL;
+    } else if (!strcmp(name, "#")) {
+        snprintf(count, sizeof(count), "%d", posparam_c > 0 ? posparam_c - 1 : 0);
+        return count;
+    } else if (!strcmp(name, "?")) {
+        snprintf(count, sizeof(count), "%d", last_status);
+        return count;
+    } else if (!strcmp(name, "@") || !strcmp(name, "*")) {
+        size_t len = 1;
+
+        for (idx = 1; idx < posparam_c; idx++) {
+            len += strlen(posparams[idx]) + 1;
+        }
+        if (len > joined_alloc) {
+            joined_alloc = len;
+            joined = realloc(joined, sizeof(char) * joined_alloc);
+        }
+
+        joined[0] = '\0';
+        for (idx = 1; idx < posparam_c; idx++) {
+            if (idx > 1)
+                strcat(joined, " ");
+            strcat(joined, posparams[idx]);
+        }
+        return joined;
+    }
+
+    return getvar(name);
+}
+
+/**
+ * copies the environment we were started with into the
+ * variable table, everything in it stays exported.
+**/
+void importenv() {
+    const char *equals;
+    char *name;
+    int idx;
+
+    for (idx = 0; environ[idx] != NULL; idx++) {
+        if ((equals = strchr(environ[idx], '=')) == NULL || !validname(environ[idx], equals - environ[idx]))
+            continue;
+        name = strndup(environ[idx], equals - environ[idx]);
+        setvar(name, equals + 1, 1);
+        free(name);
+    }
+}
+
+/* looks up name in the variable table */
+struct shell_var *findvar(const char *name) {
+    struct shell_var *var;
+
+    for (var = var_table[strhash(name, 0) & (VAR_BUCKETS - 1)]; var; var = var->next) {
+        if (!strcmp(var->name, name))
+            return var;
+    }
+
+    return NULL;
+}
+
+/* returns the value of variable name or NULL if it isn't set */
+const char *getvar(const char *name) {
+    const struct shell_var *var;
+    const char *value;
+
+    if (var_overlay != NULL && (value = overlayvalue(name)) != NULL)
+        return value;
+
+    var = findvar(name);
+    return var ? var->value : NULL;
+}
+
+/* returns the value a NAME=value in front of the running command gave name */
+const char *overlayvalue(const char *name) {
+    const struct var_overlay *overlay;
+    size_t len = strlen(name);
+    int idx;
+
+    for (overlay = var_overlay; overlay; overlay = overlay->outer) {
+        for (idx = overlay->count - 1; idx >= 0; idx--) {
+            if (!strncmp(overlay->assigns[idx], name, len) && overlay->assigns[idx][len] == '=')
+                return overlay->assigns[idx] + len + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * sets variable name to value, export also exports it
+ * a NULL value keeps the value it has. exported variables
+ * only end up in the environment of the next child.
+ * returns 0, or -1 if name isn't a valid name
+**/
+int setvar(const char *name, const char *value, int export) {
+    struct shell_var *var = findvar(name);
+    size_t namelen = strlen(name);
+
+    if (!validname(name, namelen))
+        return -1;
+
+    if (var == NULL) {
+        var = calloc(1, sizeof(struct shell_var));
+        var->name = strdup(name);
+        var->next = var_table[strhash(name, 0) & (VAR_BUCKETS - 1)];
+        var_table[strhash(name, 0) & (VAR_BUCKETS - 1)] = var;
+        var_c++;
+    }
+
+    if (export && !var->exported) {
+        var->exported = 1;
+        var_exported++;
+        var_dirty = 1;
+    }
+
+    if (value != NULL) {
+        char *entry = malloc(sizeof(char) * (namelen + strlen(value) + 2));
+        sprintf(entry, "%s=%s", name, value);
+
+        /* environ may still point to the old one */
+        if (var->published) {
+            var_retired = realloc(var_retired, sizeof(char *) * (var_retired_c + 1));
+            var_retired[var_retired_c++] = var->entry;
+        } else {
+            free(var->entry);
+        }
+
+        var->entry = entry;
+        var->value = entry + namelen + 1;
+        var->published = 0;
+        if (var->exported)
+            var_dirty = 1;
+    }
+
+    if (!strcmp(name, "PATH"))
+        clearhash();
+    return 0;
+}
+
+/* checks if the first len chars of name are a valid variable name */
+int validname(const char *name, size_t len) {
+    size_t pos;
+
+    if (len == 0 || (!isalpha((unsigned char) name[0]) && name[0] != '_'))
+        return 0;
+    for (pos = 1; pos < len; pos++) {
+        if (!isalnum((unsigned char) name[pos]) && name[pos] != '_')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * returns the environment for a new child
+ * it's only put together again if an exported variable
+ * changed since the last time. environ is pointed at it
+ * too, for execvp and whatever else in libc reads it.
+**/
+char **exportvars() {
+    struct shell_var *var;
+    int bucket, count = 0;
+
+    if (!var_dirty)
+        return var_envp;
+
+    var_envp = realloc(var_envp, sizeof(char *) * (var_exported + 1));
+    for (bucket = 0; bucket < VAR_BUCKETS; bucket++) {
+        for (var = var_table[bucket]; var; var = var->next) {
+            if (var->exported && var->entry != NULL) {
+                var_envp[count++] = var->entry;
+                var->published = 1;
+            }
+        }
+    }
+    var_envp[count] = NULL;
+    environ = var_envp;
+    var_dirty = 0;
+
+    /* nothing points to the replaced entries anymore */
+    while (var_retired_c > 0) {
+        free(var_retired[--var_retired_c]);
+    }
+
+    return var_envp;
+}
+
+/**
+ * returns the environment for a new child: the exported
+ * variables, with the NAME=value words in front of the
+ * command on top. those are passed to the child as they
+ * are, so nothing in the table changes for them.
+ * if it isn't var_envp, it was allocated for this child.
+**/
+char **childenv() {
+    char **base = exportvars(), **envp;
+    const struct var_overlay *overlay;
+    int count, total = 0, added = 0, own, idx, other;
+
+    if (var_overlay == NULL)
+        return base;
+
+    for (count = 0; base[count] != NULL; count++);
+    for (overlay = var_overlay; overlay; overlay = overlay->outer) {
+        total += overlay->count;
+    }
+    envp = malloc(sizeof(char *) * (count + total + 1));
+
+    /* the innermost and last assignment of a name wins */
+    for (overlay = var_overlay; overlay; overlay = overlay->outer) {
+        for (idx = overlay->count - 1; idx >= 0; idx--) {
+            for (other = 0; other < added && !samevar(envp[other], overlay->assigns[idx]); other++);
+            if (other == added)
+                envp[added++] = overlay->assigns[idx];
+        }
+    }
+
+    own = added;
+    for (idx = 0; idx < count; idx++) {
+        for (other = 0; other < own && !samevar(envp[other], base[idx]); other++);
+        if (other == own)
+            envp[added++] = base[idx];
+    }
+    envp[added] = NULL;
+
+    return envp;
+}
+
+/* checks if two name=value entries are for the same name */
+int samevar(const char *entry, const char *other) {
+    size_t len = strcspn(entry, "=");
+
+    return !strncmp(entry, other, len) && other[len] == '=';
+}
+
+/**
+ * splits str at delim into array with length elements
+**/
+void dtmsplit(char *str, char *delim, char ***array, int *length) {
+    int i = 0;
+    char *token, *saveptr;
+    char **res = malloc(sizeof(char *) * 2);
+
+    /* get the first token, strtok_r as the indexer thread uses this */
+    token = strtok_r(str, delim, &saveptr);
+    while (token != NULL) {
+        res = (char **) realloc(res, (i + 2) * sizeof(char *));
+        res[i] = token;
+        token = strtok_r(NULL, delim, &saveptr);
+        i++;
+    }
+
+    *array = res;
+    *length = i;
+}
+
+/**
+ * returns the offset of the char that closes the command
+ * substitution at str + start, $( ) or ` `, or -1 if it
+ * isn't closed
+**/
+int substitution_end(const char *str, int start) {
+    int pos, depth = 1, in_quotes = 0;
+
+    if (str[start] == '`') {
+        for (pos = start + 1; str[pos] != '\0'; pos++) {
+            if (str[pos] == '\\' && str[pos + 1] != '\0')
+                pos++;
+            else if (str[pos] == '`')
+                return pos;
+        }
+        return -1;
+    }
+
+    for (pos = start + 2; str[pos] != '\0'; pos++) {
+        if (str[pos] == '\\' && in_quotes != 2 && str[pos + 1] != '\0') {
+            pos++;
+        } else if (str[pos] == '"' && in_quotes != 2) {
+            in_quotes = !in_quotes;
+        } else if (str[pos] == '\'' && in_quotes != 1) {
+            in_quotes = in_quotes ? 0 : 2;
+        } else if (!in_quotes && str[pos] == '(') {
+            depth++;
+        } else if (!in_quotes && str[pos] == ')' && --depth == 0) {
+            return pos;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * runs command and returns what it printed, without trailing
+ * newlines. the result is malloc'd, its length ends up in len.
+ * builtins without side effects run right here with stdout
+ * pointed at a buffer, a single binary is spawned onto a pipe
+ * and only everything else needs a forked copy of the shell.
+**/
+char *substitute(const char *command, size_t *len, struct arena *arena) {
+    char *output = NULL, **argv = NULL;
+    size_t alloc = 0;
+    int argc = 0, fds[2], simple = strpbrk(command, ";&|<>`$(") == NULL;
+    pid_t chpid;
+
+    *len = 0;
+    if (simple) {
+        dtmparse(arena_strdup(arena, command), &argv, &argc, arena);
+        if (argc == 0)
+            return calloc(1, sizeof(char));
+        argv[argc] = NULL;
+    }
+
+    const struct builtin *builtin = simple ? findbuiltin(argv[0]) : NULL;
+    int plain = simple && !findalias(argv[0]) && !findfunction(argv[0]);
+
+    if (plain && builtin && builtin->capture) {
+        FILE *saved = stdout;
+
+        fflush(stdout);
+        stdout = open_memstream(&output, &alloc);
+        builtin->func(argc, argv);
+        fclose(stdout);
+        stdout = saved;
+
+        for (*len = alloc; *len > 0 && output[*len - 1] == '\n'; (*len)--);
+        output[*len] = '\0';
+        return output;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return calloc(1, sizeof(char));
+    }
+
+    if (plain && !isbuiltin(argv[0])) {
+        struct pipe_stage stage = { argv, argc, NULL, 0, NULL, 0 };
+        int saved_jobcontrol = jobcontrol;
+
+        /* the child stays in our process group, it's part of this command */
+        jobcontrol = 0;
+        chpid = launchstage(&stage, -1, fds[1], 0, 1, 0);
+        jobcontrol = saved_jobcontrol;
+    } else {
+        fflush(stdout);
+        chpid = fork();
+        if (chpid == 0) {
+            jobcontrol = 0;
+            resetsigchld();
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            dup2(fds[1], STDOUT_FILENO);
+
+            int status = shell_runline(arena_strdup(arena, command), arena);
+            fflush(stdout);
+            _exit(status == -1 ? last_status : status);
+        } else if (chpid == -1) {
+            perror("fork");
+        }
+    }
+    close(fds[1]);
+
+    /* collect everything it prints */
+    for (;;) {
+        if (*len + 1 >= alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            output = realloc(output, sizeof(char) * alloc);
+        }
+
+        ssize_t got = read(fds[0], output + *len, alloc - *len - 1);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        *len += got;
+    }
+    close(fds[0]);
+
+    /* reaping goes through the job table, like for every other child */
+    if (chpid > 0) {
+        struct job *job = addjob(&chpid, 1, 0, command);
+        waitjob(job);
+        removejob(job);
+    }
+
+    while (*len > 0 && output[*len - 1] == '\n') {
+        (*len)--;
+    }
+    output[*len] = '\0';
+    return output;
+}
+
+/**
+ * splits line into its commands at ;, newlines, &&, || and &
+ * quotes, escapes and command substitutions are skipped over
+ * as a whole, runs of ordinary chars are skipped with strcspn.
+ * the operators are overwritten with NULs.
+ * returns the commands, count is set to how many there are.
+**/
+struct line_command *splitline(char *line, int *count, struct arena *arena) {
+    struct line_command *commands;
+    char *pos = line, *start = line, *text;
+    int alloc = 8, op = 0, next_op, background, in_quotes = 0, end;
+
+    commands = arena_alloc(arena, sizeof(struct line_command) * alloc);
+    *count = 0;
+
+    for (;;) {
+        pos += strcspn(pos, in_quotes == 2 ? "'" : in_quotes == 1 ? "\\\"`$" : "\\'\"`$;&|\n");
+
+        switch (*pos) {
+            case '\\':
+                pos += pos[1] != '\0' ? 2 : 1;
+                continue;
+            case '\'':
+                in_quotes = in_quotes ? 0 : 2;
+                pos++;
+                continue;
+            case '"':
+                in_quotes = !in_quotes;
+                pos++;
+                continue;
+            case '`':
+            case '$':
+                /* command substitutions are kept whole */
+                if ((*pos == '`' || pos[1] == '(') && (end = substitution_end(pos, 0)) != -1)
+                    pos += end;
+                pos++;
+                continue;
+            case '|':
+                if (pos[1] != '|') {
+                    pos++;
+                    continue;
+                }
+                break;
+            case '&':
+                /* >&, <& and &> are redirections */
+                if (pos[1] != '&' && ((pos > line && (pos[-1] == '>' || pos[-1] == '<')) || pos[1] == '>')) {
+                    pos++;
+                    continue;
+                }
+                break;
+        }
+
+        /* the end of a command */
+        next_op = 0;
+        background = 0;
+        if ((pos[0] == '&' && pos[1] == '&') || (pos[0] == '|' && pos[1] == '|')) {
+            next_op = pos[0] == '&' ? 1 : 2;
+            *pos++ = '\0';
+        } else if (*pos == '&') {
+            background = 1;
+        }
+        end = *pos == '\0';
+        *pos = '\0';
+
+        for (text = start; *text == ' ' || *text == '\t'; text++);
+        if (*text != '\0') {
+            if (*count == alloc) {
+                commands = arena_grow(arena, commands, sizeof(struct line_command) * alloc, sizeof(struct line_command) * alloc * 2);
+                alloc *= 2;
+            }
+            commands[*count].text = text;
+            commands[*count].op = op;
+            commands[*count].background = background;
+            (*count)++;
+            op = next_op;
+        } else if (next_op) {
+            op = next_op;
+        }
+
+        if (end)
+            return commands;
+        start = ++pos;
+    }
+}
+
+/**
+ * parses str with shell syntax
+ * one pass over str, expanding variables and command
+ * substitutions on the way. runs of ordinary chars are
+ * found with strcspn and copied at once, and words are
+ * pointers into one buffer, sized for the worst case up
+ * front and cut down to what was used in the end.
+ * a | becomes a NULL word and redirection operators become
+ * words of their own that start with REDIR_MARK.
+**/
+void dtmparse(char *str, char ***array, int *length, struct arena *arena) {
+    struct parse_state ps;
+    size_t len = strlen(str), run, outlen, outpos;
+    char name[256], *pos = str, *end;
+    const char *value;
+    int in_quotes = 0, close;
+
+    /* words go first, so the buffer after them can grow in place */
+    ps.arena = arena;
+    ps.word_alloc = len + 2;
+    ps.word_c = 0;
+    ps.words = arena_alloc(arena, sizeof(char *) * ps.word_alloc);
+    ps.alloc = 3 * len + 2;     /* ">a" turns 2 chars into 5 */
+    ps.len = 0;
+    ps.out = arena_alloc(arena, sizeof(char) * ps.alloc);
+    ps.open = 0;
+
+    for (;;) {
+        /* ordinary chars */
+        run = strcspn(pos, in_quotes ? "\\\"`$" : " \t\n|<>'\"\\`$");
+        if (run > 0) {
+            parse_append(&ps, pos, run);
+            pos += run;
+        }
+
+        switch (*pos) {
+            case '\0':
+                if (in_quotes) {
+                    panic("syntax error", "unterminated quote found\n");
+                    *array = NULL;
+                    *length = 0;
+                    return;
+                }
+                parse_endword(&ps);
+
+                /* what's left of the buffer goes back to the arena */
+                if (ps.out == arena->last)
+                    arena_grow(arena, ps.out, ps.alloc, ps.len);
+                ps.words[ps.word_c] = NULL;
+                *array = ps.words;
+                *length = ps.word_c;
+                return;
+            case ' ':
+            case '\t':
+            case '\n':
+                parse_endword(&ps);
+                pos++;
+                break;
+            case '|':
+                /* a marker for the pipeline split */
+                parse_endword(&ps);
+                parse_push(&ps, NULL);
+                pos++;
+                break;
+            case '<':
+            case '>':
+                /* an fd number (or &) right before belongs to the operator */
+                if (ps.open) {
+                    char *word = ps.words[ps.word_c - 1];
+                    size_t wordlen = ps.out + ps.len - word;
+                    if ((wordlen > 0 && strspn(word, "0123456789") == wordlen) || (wordlen == 1 && word[0] == '&')) {
+                        parse_reserve(&ps, 1);
+                        word = ps.words[ps.word_c - 1];
+                        memmove(word + 1, word, wordlen);
+                        word[0] = REDIR_MARK;
+                        ps.len++;
+                    } else {
+                        parse_endword(&ps);
+                        parse_append(&ps, (char []) { REDIR_MARK }, 1);
+                    }
+                } else {
+                    parse_append(&ps, (char []) { REDIR_MARK }, 1);
+                }
+
+                /* the operator becomes a word of its own, the target is the next one */
+                run = 1;
+                if (pos[0] == '>' && (pos[1] == '>' || pos[1] == '&'))
+                    run = 2;
+                else if (pos[0] == '<' && (pos[1] == '&' || pos[1] == '>'))
+                    run = 2;
+                else if (pos[0] == '<' && pos[1] == '<')
+                    run = pos[2] == '<' || pos[2] == '-' ? 3 : 2;
+                parse_append(&ps, pos, run);
+                parse_endword(&ps);
+                pos += run;
+
+                /* >| is just > */
+                if (run == 1 && pos[-1] == '>' && pos[0] == '|')
+                    pos++;
+                break;
+            case '\'':
+                /* everything up to the next ' is literal */
+                if ((end = strchr(pos + 1, '\'')) == NULL) {
+                    panic("syntax error", "unterminated quote found\n");
+                    *array = NULL;
+                    *length = 0;
+                    return;
+                }
+                parse_open(&ps);
+                parse_append(&ps, pos + 1, end - pos - 1);
+                pos = end + 1;
+                break;
+            case '"':
+                parse_open(&ps);
+                in_quotes = !in_quotes;
+                pos++;
+                break;
+            case '\\':
+                /* in double quotes, only a few chars can be escaped */
+                if (pos[1] == '\0') {
+                    pos++;
+                } else if (in_quotes && strchr("$`\"\\\n", pos[1]) == NULL) {
+                    parse_append(&ps, pos, 2);
+                    pos += 2;
+                } else {
+                    parse_append(&ps, pos + 1, 1);
+                    pos += 2;
+                }
+                break;
+            case '`':
+            case '$':
+                if (*pos == '`' || pos[1] == '(') {
+                    if ((close = substitution_end(pos, 0)) == -1) {
+                        parse_append(&ps, pos++, 1);
+                        break;
+                    }
+
+                    /* terminate the command, it's run as its own line (but not with -n) */
+                    pos[close] = '\0';
+                    char *output = flags & 1 << 3 ? calloc(1, sizeof(char)) : substitute(pos + (*pos == '$' ? 2 : 1), &outlen, arena);
+                    if (flags & 1 << 3)
+                        outlen = 0;
+                    pos += close + 1;
+
+                    /* unquoted output is split into words, except in NAME=value */
+                    if (in_quotes || parse_inassign(&ps)) {
+                        parse_append(&ps, output, outlen);
+                    } else {
+                        for (outpos = 0; outpos < outlen; outpos += run) {
+                            if ((run = strcspn(output + outpos, " \t\n")) > 0) {
+                                parse_append(&ps, output + outpos, run);
+                            } else {
+                                parse_endword(&ps);
+                                run = 1;
+                            }
+                        }
+                    }
+                    free(output);
+                    break;
+                }
+
+                /* find the name, special parameters are one char long */
+                end = NULL;
+                if (pos[1] == '{') {
+                    if ((end = strchr(pos + 2, '}')) == NULL) {
+                        panic("syntax error", "unclosed curly braces found\n");
+                        *array = NULL;
+                        *length = 0;
+                        return;
+                    }
+                    run = end - pos - 2;
+                    value = pos + 2;
+                    end++;
+                } else if (pos[1] != '\0' && haschar("0123456789#@*?", pos[1])) {
+                    run = 1;
+                    value = pos + 1;
+                    end = pos + 2;
+                } else if (isalpha((unsigned char) pos[1]) || pos[1] == '_') {
+                    for (end = pos + 2; isalnum((unsigned char) *end) || *end == '_'; end++);
+                    run = end - pos - 1;
+                    value = pos + 1;
+                } else if (!in_quotes && (pos[1] == '"' || pos[1] == '\'')) {
+                    /* $"..." and $'...' are just quotes */
+                    pos++;
+                    break;
+                } else {
+                    /* a lone $ */
+                    parse_append(&ps, pos++, 1);
+                    break;
+                }
+
+                if (run >= sizeof(name))
+                    run = sizeof(name) - 1;
+                memcpy(name, value, run);
+                name[run] = '\0';
+                pos = end;
+
+                if ((value = lookupvar(name)) != NULL) {
+                    parse_append(&ps, value, strlen(value));
+                } else {
+#ifdef DEBUG_OUTPUT
+                    panic("getenv", "variable not found in environment\n");
+#endif
+                    /* "$unset" is still an (empty) word */
+                    if (in_quotes)
+                        parse_open(&ps);
+                }
+                break;
+        }
+    }
+}
+
+/* makes sure the parse buffer has room for extra more chars and a NUL */
+void parse_reserve(struct parse_state *ps, size_t extra) {
+    char *old = ps->out;
+    int idx;
+
+    if (ps->len + extra + 1 <= ps->alloc)
+        return;
+
+    ps->out = arena_grow(ps->arena, ps->out, ps->alloc, (ps->len + extra + 1) * 2);
+    ps->alloc = (ps->len + extra + 1) * 2;
+
+    /* the arena had to move it, so the words move too */
+    if (ps->out != old) {
+        for (idx = 0; idx < ps->word_c; idx++) {
+            if (ps->words[idx] != NULL)
+                ps->words[idx] = ps->out + (ps->words[idx] - old);
+        }
+    }
+}
+
+/* starts a new word, unless one is started already */
+void parse_open(struct parse_state *ps) {
+    if (ps->open)
+        return;
+    parse_reserve(ps, 1);
+    parse_push(ps, ps->out + ps->len);
+    ps->open = 1;
+}
+
+/* adds len chars of src to the current word */
+void parse_append(struct parse_state *ps, const char *src, size_t len) {
+    parse_open(ps);
+    parse_reserve(ps, len);
+    memcpy(ps->out + ps->len, src, len);
+    ps->len += len;
+}
+
+/* ends the current word, if there is one */
+void parse_endword(struct parse_state *ps) {
+    if (!ps->open)
+        return;
+    parse_reserve(ps, 0);
+    ps->out[ps->len++] = '\0';
+    ps->open = 0;
+}
+
+/* adds word to the list, with room for the NULL at the end */
+void parse_push(struct parse_state *ps, char *word) {
+    if (ps->word_c + 2 > ps->word_alloc) {
+        ps->words = arena_grow(ps->arena, ps->words, sizeof(char *) * ps->word_alloc, sizeof(char *) * ps->word_alloc * 2);
+        ps->word_alloc *= 2;
+    }
+    ps->words[ps->word_c++] = word;
+}
+
+/**
+ * whether the word being parsed assigns a variable: it starts
+ * with NAME= and only assignments and redirections are in front
+ * of it in its pipeline stage.
+**/
+int parse_inassign(const struct parse_state *ps) {
+    const char *word, *equals;
+    int idx;
+
+    if (!ps->open)
+        return 0;
+    word = ps->words[ps->word_c - 1];
+    if ((equals = memchr(word, '=', ps->out + ps->len - word)) == NULL || !validname(word, equals - word))
+        return 0;
+
+    for (idx = ps->word_c - 2; idx >= 0 && ps->words[idx] != NULL; idx--) {
+        word = ps->words[idx];
+        if (word[0] == REDIR_MARK || (idx > 0 && ps->words[idx - 1] != NULL && ps->words[idx - 1][0] == REDIR_MARK))
+            continue;
+        if ((equals = strchr(word, '=')) == NULL || !validname(word, equals - word))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * opens the history log at path and loads its last HISTSIZE
+ * entries. the log is mapped and only its tail is looked at,
+ * so this takes the same time no matter how long it got.
+**/
+void historyopen(const char *path) {
+    struct stat st;
+    const char *map, *pos, *window, *next, *newline;
+    size_t len;
+    int lines;
+
+    if ((history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        perror(path);
+        return;
+    }
+    if (fstat(history.fd, &st) == -1 || st.st_size == 0)
+        return;
+    len = st.st_size;
+    if ((map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, history.fd, 0)) == MAP_FAILED)
+        return;
+
+    /* walk back HISTSIZE lines, a crash may have eaten the last newline */
+    window = map;
+    pos = map + len - (map[len - 1] == '\n');
+    for (lines = 0; lines < HISTSIZE && (newline = memrchr(map, '\n', pos - map)) != NULL; lines++) {
+        window = newline + 1;
+        pos = newline;
+    }
+    if (lines < HISTSIZE)
+        window = map;
+
+    for (pos = window; pos < map + len; pos = next + 1) {
+        if ((next = memchr(pos, '\n', map + len - pos)) == NULL)
+            next = map + len;
+        if (next > pos) {
+            char *line = strndup(pos, next - pos);
+            historyadd(line, 0);
+            free(line);
+        }
+    }
+
+    /* finish a line a crash cut off, or the next one gets glued to it */
+    if (map[len - 1] != '\n' && write(history.fd, "\n", 1) == -1)
+        perror("history");
+
+    munmap((void *) map, len);
+}
+
+/**
+ * adds line to the history and, if save is set, to the log
+ * every line goes out in a single O_APPEND write, so shells
+ * sharing the log never mix up their lines.
+**/
+void historyadd(const char *line, int save) {
+    int idx;
+
+    /* linenoise drops repeated lines too */
+    if (line[0] == '\0' || (history.count > 0 && !strcmp(history.entries[history.count - 1], line)))
+        return;
+
+    linenoiseHistoryAdd(line);
+    recordusage(line);
+
+    /* keep between HISTSIZE and twice that in memory */
+    if (history.count == 2 * HISTSIZE) {
+        for (idx = 0; idx < HISTSIZE; idx++) {
+            free(history.entries[idx]);
+        }
+        memmove(history.entries, history.entries + HISTSIZE, sizeof(char *) * HISTSIZE);
+        history.count = HISTSIZE;
+        history.base += HISTSIZE;
+
+        /* ids moved, the index is built again on the next search */
+        for (idx = 0; idx < (int) history.gram_slots; idx++) {
+            free(history.grams[idx].ids);
+        }
+        free(history.grams);
+        history.grams = NULL;
+        history.gram_slots = history.gram_c = 0;
+        history.indexed = 0;
+    }
+    if (history.count == history.alloc) {
+        history.alloc = history.alloc ? history.alloc * 2 : 64;
+        history.entries = realloc(history.entries, sizeof(char *) * history.alloc);
+    }
+    history.entries[history.count++] = strdup(line);
+
+    if (save && history.fd != -1) {
+        struct iovec iov[2] = { { (void *) line, strlen(line) }, { "\n", 1 } };
+        if (writev(history.fd, iov, 2) == -1)
+            perror("history");
+    }
+}
+
+/**
+ * adds the entries that came in since the last search to the
+ * trigram index. every trigram maps to the entries holding it,
+ * so a search only looks at lines that can match.
+**/
+void historyindex() {
+    struct history_gram *gram;
+    const unsigned char *pos;
+    unsigned int key;
+
+    for (; history.indexed < history.count; history.indexed++) {
+        pos = (const unsigned char *) history.entries[history.indexed];
+        if (pos[0] == '\0' || pos[1] == '\0')
+            continue;
+        for (; pos[2] != '\0'; pos++) {
+            key = pos[0] << 16 | pos[1] << 8 | pos[2];
+            gram = historygram(key, 1);
+
+            /* a line repeating a trigram is listed once */
+            if (gram->count > 0 && gram->ids[gram->count - 1] == history.indexed)
+                continue;
+            if (gram->count == gram->alloc) {
+                gram->alloc = gram->alloc ? gram->alloc * 2 : 4;
+                gram->ids = realloc(gram->ids, sizeof(int) * gram->alloc);
+            }
+            gram->ids[gram->count++] = history.indexed;
+        }
+    }
+}
+
+/**
+ * finds the slot for gram, linear probing
+ * returns NULL if it's missing and create isn't set
+**/
+struct history_gram *historygram(unsigned int gram, int create) {
+    unsigned int slot, idx;
+
+    if (create && (history.gram_c + 1) * 2 > history.gram_slots) {
+        struct history_gram *old = history.grams;
+        unsigned int old_slots = history.gram_slots;
+
+        history.gram_slots = old_slots ? old_slots * 2 : 1024;
+        history.grams = calloc(history.gram_slots, sizeof(struct history_gram));
+        for (idx = 0; idx < old_slots; idx++) {
+            if (old[idx].gram == 0)
+                continue;
+            slot = (old[idx].gram * 2654435761u) & (history.gram_slots - 1);
+            while (history.grams[slot].gram != 0) {
+                slot = (slot + 1) & (history.gram_slots - 1);
+            }
+            history.grams[slot] = old[idx];
+        }
+        free(old);
+    }
+    if (history.gram_slots == 0)
+        return NULL;
+
+    slot = (gram * 2654435761u) & (history.gram_slots - 1);
+    while (history.grams[slot].gram != 0) {
+        if (history.grams[slot].gram == gram)
+            return &history.grams[slot];
+        slot = (slot + 1) & (history.gram_slots - 1);
+    }
+    if (!create)
+        return NULL;
+
+    history.gram_c++;
+    history.grams[slot].gram = gram;
+    return &history.grams[slot];
+}
+
+/**
+ * returns the newest entry below before that contains text,
+ * or starts with it if prefix is set, -1 if there is none
+ * text shorter than a trigram is looked for line by line.
+**/
+int historysearch(const char *text, int prefix, int before) {
+    const struct history_gram *gram, *rarest = NULL;
+    const unsigned char *pos = (const unsigned char *) text;
+    int idx;
+
+    if (before > history.count)
+        before = history.count;
+
+    if (pos[0] == '\0' || pos[1] == '\0' || pos[2] == '\0') {
+        for (idx = before - 1; idx >= 0; idx--) {
+            if (prefix ? startswith(history.entries[idx], text) : strstr(history.entries[idx], text) != NULL)
+                return idx;
+        }
+        return -1;
+    }
+
+    /* every match holds all trigrams of text, walk the shortest list */
+    historyindex();
+    for (; pos[2] != '\0'; pos++) {
+        if ((gram = historygram(pos[0] << 16 | pos[1] << 8 | pos[2], 0)) == NULL)
+            return -1;
+        if (rarest == NULL || gram->count < rarest->count)
+            rarest = gram;
+    }
+
+    for (idx = rarest->count - 1; idx >= 0; idx--) {
+        int id = rarest->ids[idx];
+        if (id >= before)
+            continue;
+        if (prefix ? startswith(history.entries[id], text) : strstr(history.entries[id], text) != NULL)
+            return id;
+    }
+    return -1;
+}
+
+/**
+ * looks up the event spec (the part after !) points to:
+ * !! is the last line, !n line n, !-n the nth last one,
+ * !text the last one starting with text and !?text? the
+ * last one containing text. speclen is set to how much of
+ * spec it took, returns NULL if there is no such line.
+**/
+const char *historyevent(const char *spec, size_t *speclen) {
+    char *text, *end;
+    int idx, prefix = 1;
+
+    if (spec[0] == '!') {
+        *speclen = 1;
+        return history.count > 0 ? history.entries[history.count - 1] : NULL;
+    }
+
+    if (isdigit((unsigned char) spec[0]) || (spec[0] == '-' && isdigit((unsigned char) spec[1]))) {
+        long num = strtol(spec, &end, 10);
+        *speclen = end - spec;
+        idx = num < 0 ? history.count + num : num - 1 - history.base;
+        return idx >= 0 && idx < history.count ? history.entries[idx] : NULL;
+    }
+
+    if (spec[0] == '?') {
+        prefix = 0;
+        *speclen = strcspn(spec + 1, "?\n") + 1;
+        text = strndup(spec + 1, *speclen - 1);
+        *speclen += spec[*speclen] == '?';
+    } else {
+        *speclen = strcspn(spec, " \t\n;&|<>()'\"");
+        text = strndup(spec, *speclen);
+    }
+
+    idx = text[0] == '\0' ? -1 : historysearch(text, prefix, history.count);
+    free(text);
+    return idx == -1 ? NULL : history.entries[idx];
+}
+
+/**
+ * replaces the history events in line, but not in single
+ * quotes or after a backslash. a ! before a blank, =, ( or "
+ * stays as it is. returns a malloc'd line, or NULL after
+ * printing an error if an event wasn't found.
+**/
+char *expandhistory(const char *line) {
+    size_t len = 0, alloc = strlen(line) + 1, speclen, eventlen;
+    char *res = malloc(sizeof(char) * alloc);
+    const char *pos, *event;
+    int in_quotes = 0;          /* 1 in single, 2 in double quotes */
+
+    for (pos = line; *pos != '\0'; pos++) {
+        if (*pos == '!' && in_quotes != 1 && pos[1] != '\0' && strchr(" \t\n=(\"", pos[1]) == NULL) {
+            if ((event = historyevent(pos + 1, &speclen)) == NULL) {
+                fprintf(stderr, "%.*s: event not found\n", (int) speclen + 1, pos);
+                free(res);
+                return NULL;
+            }
+
+            eventlen = strlen(event);
+            if (len + eventlen + strlen(pos) + 1 > alloc) {
+                alloc = len + eventlen + strlen(pos) + 1;
+                res = realloc(res, sizeof(char) * alloc);
+            }
+            memcpy(res + len, event, eventlen);
+            len += eventlen;
+            pos += speclen;
+            continue;
+        }
+
+        if (*pos == '\'' && in_quotes != 2) {
+            in_quotes = in_quotes ? 0 : 1;
+        } else if (*pos == '"' && in_quotes != 1) {
+            in_quotes = in_quotes ? 0 : 2;
+        } else if (*pos == '\\' && pos[1] != '\0' && in_quotes != 1) {
+            res[len++] = *pos++;
+        }
+        res[len++] = *pos;
+    }
+    res[len] = '\0';
+
+    return res;
+}
+
+/**
+ * returns the prompt for the next line
+ * PS1 is only compiled when it changes, and the rendered
+ * prompt is reused until something it shows changes.
+**/
+const char *renderprompt() {
+    const char *source = getvar("PS1") ? getvar("PS1") : DEFAULTPROMPT;
+    const char *branch = NULL, *text, *home_end;
+    char scratch[MAXCURDIRLEN + 12];
+    size_t len = 0, alloc = 64, textlen;
+    int seg;
+
+    if (prompt_template.source == NULL || strcmp(prompt_template.source, source))
+        compileprompt(source);
+
+    if (prompt_template.deps & PROMPT_DEP_GIT)
+        branch = gitbranch(curdir);
+
+    if (prompt_template.rendered != NULL &&
+        (!(prompt_template.deps & PROMPT_DEP_CWD) || !strcmp(prompt_template.cwd, curdir)) &&
+        (!(prompt_template.deps & PROMPT_DEP_STATUS) || prompt_template.status == last_status) &&
+        (!(prompt_template.deps & PROMPT_DEP_GIT) || !strcmp(prompt_template.branch, branch ? branch : "")))
+        return prompt_template.rendered;
+
+    free(prompt_template.rendered);
+    prompt_template.rendered = malloc(sizeof(char) * alloc);
+
+    /* home is shortened to ~ if it's a whole path component */
+    home_end = startswith(curdir, homedir) && homedir[1] != '\0' &&
+               (curdir[strlen(homedir)] == '\0' || curdir[strlen(homedir)] == '/') ? curdir + strlen(homedir) : NULL;
+
+    for (seg = 0; seg < prompt_template.count; seg++) {
+        const struct prompt_segment *segment = &prompt_template.segments[seg];
+        text = "";
+        textlen = 0;
+
+        switch (segment->type) {
+            case PROMPT_TEXT:
+                text = segment->text;
+                textlen = segment->len;
+                break;
+            case PROMPT_USER:
+                text = username;
+                break;
+            case PROMPT_HOST:
+                text = hostname;
+                textlen = strcspn(hostname, ".");
+                break;
+            case PROMPT_FULLHOST:
+                text = hostname;
+                break;
+            case PROMPT_CWD:
+                text = curdir;
+                break;
+            case PROMPT_TILDECWD:
+                if (home_end) {
+                    snprintf(scratch, sizeof(scratch), "~%s", home_end);
+                    text = scratch;
+                } else {
+                    text = curdir;
+                }
+                break;
+            case PROMPT_BASENAME:
+                if (home_end && *home_end == '\0')
+                    text = "~";
+                else if (curdir[0] == '/' && curdir[1] == '\0')
+                    text = curdir;
+                else
+                    text = strrchr(curdir, '/') ? strrchr(curdir, '/') + 1 : curdir;
+                break;
+            case PROMPT_DOLLAR:
+                text = geteuid() == 0 ? "#" : "$";
+                break;
+            case PROMPT_STATUS:
+                snprintf(scratch, sizeof(scratch), "%d", last_status);
+                text = scratch;
+                break;
+            case PROMPT_GIT:
+                text = branch ? branch : "";
+                break;
+        }
+
+        if (segment->type != PROMPT_TEXT && segment->type != PROMPT_HOST)
+            textlen = strlen(text);
+
+        if (len + textlen + 1 > alloc) {
+            alloc = (len + textlen + 1) * 2;
+            prompt_template.rendered = realloc(prompt_template.rendered, sizeof(char) * alloc);
+        }
+        memcpy(prompt_template.rendered + len, text, textlen);
+        len += textlen;
+    }
+    prompt_template.rendered[len] = '\0';
+
+    /* remember what this rendering shows */
+    free(prompt_template.cwd);
+    free(prompt_template.branch);
+    prompt_template.cwd = strdup(curdir);
+    prompt_template.status = last_status;
+    prompt_template.branch = strdup(branch ? branch : "");
+
+    return prompt_template.rendered;
+}
+
+/**
+ * splits source into literal text and placeholders
+ * understands the %1$s (user), %2$s (host) and %3$s (cwd)
+ * of the old printf-style prompts as well as the bash
+ * escapes \u \h \H \w \W \$ \? \n \e \\ and \g for the git
+ * branch. source is never used as a format string.
+**/
+void compileprompt(const char *source) {
+    const char *pos, *text = NULL;
+    char *literal, ch;
+    int type;
+
+    free(prompt_template.source);
+    free(prompt_template.segments);
+    free(prompt_template.rendered);
+    prompt_template.source = strdup(source);
+    prompt_template.rendered = NULL;
+    prompt_template.count = 0;
+    prompt_template.deps = 0;
+
+    /* literals are copied, escapes like \n and %% make them differ from source */
+    prompt_template.segments = malloc(sizeof(struct prompt_segment) * (strlen(source) + 1) + strlen(source) + 1);
+    literal = (char *) (prompt_template.segments + strlen(source) + 1);
+
+    for (pos = source; *pos != '\0'; pos++) {
+        type = PROMPT_TEXT;
+        ch = *pos;
+
+        if (pos[0] == '%' && pos[1] >= '1' && pos[1] <= '3' && pos[2] == '$' && pos[3] == 's') {
+            type = pos[1] == '1' ? PROMPT_USER : pos[1] == '2' ? PROMPT_FULLHOST : PROMPT_CWD;
+            pos += 3;
+        } else if (pos[0] == '%' && pos[1] == '%') {
+            pos++;
+        } else if (pos[0] == '\\' && pos[1] != '\0') {
+            switch (*++pos) {
+                case 'u': type = PROMPT_USER; break;
+                case 'h': type = PROMPT_HOST; break;
+                case 'H': type = PROMPT_FULLHOST; break;
+                case 'w': type = PROMPT_TILDECWD; break;
+                case 'W': type = PROMPT_BASENAME; break;
+                case '$': type = PROMPT_DOLLAR; break;
+                case '?': type = PROMPT_STATUS; break;
+                case 'g': type = PROMPT_GIT; break;
+                case '[':
+                case ']':
+                    /* linenoise doesn't need non-printing markers */
+                    continue;
+                case 'n': ch = '\n'; break;
+                case 'e': ch = '\033'; break;
+                case '\\': ch = '\\'; break;
+                default:
+                    /* not an escape, keep the backslash */
+                    pos--;
+                    break;
+            }
+        }
+
+        if (type != PROMPT_TEXT) {
+            if (type == PROMPT_CWD || type == PROMPT_TILDECWD || type == PROMPT_BASENAME || type == PROMPT_GIT)
+                prompt_template.deps |= PROMPT_DEP_CWD;
+            if (type == PROMPT_GIT)
+                prompt_template.deps |= PROMPT_DEP_GIT;
+            if (type == PROMPT_STATUS)
+                prompt_template.deps |= PROMPT_DEP_STATUS;
+            prompt_template.segments[prompt_template.count].type = type;
+            prompt_template.segments[prompt_template.count++].text = NULL;
+            text = NULL;
+            continue;
+        }
+
+        /* extend the current literal */
+        if (text == NULL) {
+            text = literal;
+            prompt_template.segments[prompt_template.count].type = PROMPT_TEXT;
+            prompt_template.segments[prompt_template.count].text = text;
+            prompt_template.segments[prompt_template.count++].len = 0;
+        }
+        *literal++ = ch;
+        prompt_template.segments[prompt_template.count - 1].len++;
+    }
+}
+
+/**
+ * returns the git branch dir is on, or NULL
+ * results are cached per directory and only looked up again
+ * if HEAD (or, outside of repos, the directory) changed.
+**/
+const char *gitbranch(const char *dir) {
+    struct git_cache_entry *entry = NULL;
+    struct stat st;
+    int idx;
+
+    for (idx = 0; idx < GITCACHESIZE; idx++) {
+        if (gitcache[idx].dir && !strcmp(gitcache[idx].dir, dir)) {
+            entry = &gitcache[idx];
+            break;
+        }
+    }
+
+    if (entry && stat(entry->statpath, &st) == 0 &&
+        st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+        entry->lastuse = ++gitcache_clock;
+        return entry->branch;
+    }
+
+    /* evict the least recently used entry */
+    if (entry == NULL) {
+        entry = &gitcache[0];
+        for (idx = 1; idx < GITCACHESIZE; idx++) {
+            if (gitcache[idx].lastuse < entry->lastuse)
+                entry = &gitcache[idx];
+        }
+        free(entry->dir);
+        entry->dir = strdup(dir);
+    }
+
+    free(entry->statpath);
+    free(entry->branch);
+    entry->branch = readgithead(dir, &entry->statpath);
+    entry->lastuse = ++gitcache_clock;
+    if (stat(entry->statpath, &st) == 0)
+        entry->mtime = st.st_mtim;
+    else
+        memset(&entry->mtime, 0, sizeof(struct timespec));
+
+    return entry->branch;
+}
+
+/**
+ * finds the repository dir is in and reads the branch from
+ * its HEAD (a short hash if it's detached). statpath is set
+ * to the file that has to change for the answer to change.
+**/
+char *readgithead(const char *dir, char **statpath) {
+    char path[MAXCURDIRLEN], head[256];
+    size_t len = strlen(dir);
+    struct stat st;
+    int fd;
+    ssize_t got;
+
+    *statpath = strdup(dir);
+    if (len >= MAXCURDIRLEN - 16)
+        return NULL;
+    memcpy(path, dir, len + 1);
+    if (len == 1)
+        len = 0;
+
+    /* walk up to the first dir with a .git */
+    for (;;) {
+        strcpy(path + len, "/.git");
+        if (stat(path, &st) == 0)
+            break;
+        if (len == 0)
+            return NULL;
+        while (len > 0 && path[len - 1] != '/') {
+            len--;
+        }
+        len = len > 0 ? len - 1 : 0;
+    }
+
+    /* worktrees and submodules have a file pointing to the real one */
+    if (!S_ISDIR(st.st_mode)) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+            return NULL;
+        got = read(fd, head, sizeof(head) - 1);
+        close(fd);
+        if (got <= 8 || strncmp(head, "gitdir: ", 8))
+            return NULL;
+        head[got] = '\0';
+        head[strcspn(head, "\n")] = '\0';
+        if (head[8] == '/') {
+            snprintf(path, MAXCURDIRLEN, "%s", head + 8);
+        } else {
+            path[len] = '\0';
+            snprintf(path + len, MAXCURDIRLEN - len, "/%s", head + 8);
+        }
+    }
+
+    strncat(path, "/HEAD", MAXCURDIRLEN - strlen(path) - 1);
+    free(*statpath);
+    *statpath = strdup(path);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    got = read(fd, head, sizeof(head) - 1);
+    close(fd);
+    if (got <= 0)
+        return NULL;
+    head[got] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+
+    if (!strncmp(head, "ref: ", 5))
+        return strdup(strncmp(head + 5, "refs/heads/", 11) ? head + 5 : head + 16);
+    return strndup(head, 7);
+}
+
+/**
+ * sets up input to read lines from fd
+ * regular files are mapped into memory as a whole,
+ * everything else (pipes, ttys, ...) is read in big chunks.
+**/
+void input_open(struct input_source *input, int fd) {
+    struct stat st;
+
+    memset(input, 0, sizeof(struct input_source));
+    input->fd = fd;
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            input->buf = map;
+            input->len = st.st_size;
+            input->mapped = 1;
+            return;
+        }
+    }
+
+    input->alloc = INPUT_CHUNK;
+    input->buf = malloc(sizeof(char) * input->alloc);
+}
+
+/* sets up input to read lines from str (for -c) */
+void input_string(struct input_source *input, char *str) {
+    memset(input, 0, sizeof(struct input_source));
+    input->fd = -1;
+    input->buf = str;
+    input->len = strlen(str);
+}
+
+/**
+ * reads the next line from input into arena
+ * prompt is only used for interactive input
+ * returns NULL if there is nothing left to read
+**/
+char *input_readline(struct input_source *input, const char *prompt, struct arena *arena) {
+    char *line, *newline;
+    size_t linelen;
+
+    if (input->interactive) {
+        char *command = linenoise(prompt);
+        if (!command)
+            return NULL;
+
+        /* !! and friends, the expanded line is what gets saved */
+        if (strchr(command, '!') != NULL) {
+            char *expanded = expandhistory(command);
+            if (expanded == NULL) {
+                free(command);
+                return arena_strdup(arena, "");
+            }
+            if (strcmp(expanded, command))
+                printf("%s\n", expanded);
+            free(command);
+            command = expanded;
+        }
+
+        historyadd(command, 1);
+        line = arena_strdup(arena, command);
+        free(command);
+        return line;
+    }
+
+    /* read more until we have a whole line (or the input is over) */
+    while ((newline = memchr(input->buf + input->pos, '\n', input->len - input->pos)) == NULL && !input->mapped && input->fd != -1) {
+        /* move the leftovers to the start of the buffer */
+        if (input->pos > 0) {
+            memmove(input->buf, input->buf + input->pos, input->len - input->pos);
+            input->len -= input->pos;
+            input->pos = 0;
+        }
+        if (input->len == input->alloc) {
+            input->alloc *= 2;
+            input->buf = realloc(input->buf, sizeof(char) * input->alloc);
+        }
+
+        ssize_t got = read(input->fd, input->buf + input->len, input->alloc - input->len);
+        if (got <= 0) {
+            break;
+        }
+        input->len += got;
+    }
+
+    if (input->pos >= input->len)
+        return NULL;
+
+    linelen = (newline ? (size_t) (newline - input->buf) : input->len) - input->pos;
+
+    /* copy, because parsing writes into the line */
+    line = arena_alloc(arena, linelen + 1);
+    memcpy(line, input->buf + input->pos, linelen);
+    line[linelen] = '\0';
+
+    input->pos += linelen + (newline != NULL);
+    return line;
+}
+
+/* releases everything input_open allocated */
+void input_close(struct input_source *input) {
+    if (input->mapped) {
+        munmap(input->buf, input->len);
+    } else if (input->fd != -1) {
+        free(input->buf);
+    }
+
+    if (input->fd > STDERR_FILENO) {
+        close(input->fd);
+    }
+}
+
+/* cuts off a comment (unquoted # at the start of a word) */
+void stripcomment(char *line) {
+    int in_quotes = 0, pos;
+
+    for (pos = 0; line[pos] != '\0'; pos++) {
+        switch (line[pos]) {
+            case '\\':
+                if (line[pos + 1] != '\0' && in_quotes != 2)
+                    pos++;
+                break;
+            case '\'':
+                if (in_quotes != 1)
+                    in_quotes = in_quotes ? 0 : 2;
+                break;
+            case '"':
+                if (in_quotes != 2)
+                    in_quotes = in_quotes ? 0 : 1;
+                break;
+            case '#':
+                if (!in_quotes && (pos == 0 || line[pos - 1] == ' ' || line[pos - 1] == '\t' || line[pos - 1] == ';')) {
+                    line[pos] = '\0';
+                    return;
+                }
+                break;
+        }
+    }
+}
+
+/**
+ * allocates size bytes from arena
+ * arena memory is never freed on its own, but all
+ * at once by arena_reset
+**/
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->head;
+
+    /* keep everything pointer-aligned */
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunksize = ARENA_CHUNK;
+        while (chunksize < size) {
+            chunksize *= 2;
+        }
+
+        chunk = malloc(sizeof(struct arena_chunk) + chunksize);
+        chunk->next = arena->head;
+        chunk->size = chunksize;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+
+    arena->last = chunk->data + chunk->used;
+    chunk->used += size;
+    return arena->last;
+}
+
+/**
+ * grows ptr from oldsize to newsize bytes
+ * if ptr was the last allocation and there is room left,
+ * this doesn't move anything. otherwise, it works like realloc.
+**/
+void *arena_grow(struct arena *arena, void *ptr, size_t oldsize, size_t newsize) {
+    struct arena_chunk *chunk = arena->head;
+
+    if (ptr != NULL && ptr == arena->last) {
+        size_t offset = (char *) ptr - chunk->data;
+        size_t aligned = (newsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        if (offset + aligned <= chunk->size) {
+            chunk->used = offset + aligned;
+            return ptr;
+        }
+    }
+
+    void *res = arena_alloc(arena, newsize);
+    if (ptr != NULL)
+        memcpy(res, ptr, oldsize < newsize ? oldsize : newsize);
+    return res;
+}
+
+/* strdup, but from an arena */
+char *arena_strdup(struct arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * releases everything allocated from arena
+ * if the last use needed more than one chunk, they are
+ * replaced by one chunk big enough for all of them, so
+ * the next use won't have to malloc at all.
+**/
+void arena_reset(struct arena *arena) {
+    struct arena_chunk *chunk = arena->head, *next;
+    size_t total = 0;
+
+    if (chunk == NULL)
+        return;
+
+    if (chunk->next == NULL) {
+        chunk->used = 0;
+        arena->last = NULL;
+        return;
+    }
+
+    for (; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        total += chunk->size;
+        free(chunk);
+    }
+
+    chunk = malloc(sizeof(struct arena_chunk) + total);
+    chunk->next = NULL;
+    chunk->size = total;
+    chunk->used = 0;
+    arena->head = chunk;
+    arena->last = NULL;
+}
+
+/* frees all memory of an arena */
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->head, *next;
+
+    for (; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+/**
+ * returns the (escaped) listing of targetdir
+ * listings are cached and only re-read if the dir's
+ * mtime changed since they were last used, so commands
+ * that don't touch the filesystem don't cost a rescan.
+**/
+const struct dir_listing *getlisting(const char *targetdir) {
+    char path[MAXCURDIRLEN];
+    int idx, slot = 0;
+
+    /* cache by absolute path, "." means something else after every cd */
+    if (targetdir[0] == '/') {
+        snprintf(path, MAXCURDIRLEN, "%s", targetdir);
+    } else if (!strcmp(targetdir, ".")) {
+        snprintf(path, MAXCURDIRLEN, "%s", curdir);
+    } else {
+        snprintf(path, MAXCURDIRLEN, "%s/%s", curdir, targetdir);
+    }
+
+    /* find the cached listing, or the least recently used slot */
+    for (idx = 0; idx < DIRCACHESIZE; idx++) {
+        if (dircache[idx].path != NULL && !strcmp(dircache[idx].path, path)) {
+            slot = idx;
+            break;
+        }
+        if (dircache[idx].lastuse < dircache[slot].lastuse) {
+            slot = idx;
+        }
+    }
+
+    if (idx == DIRCACHESIZE) {
+        freelisting(&dircache[slot]);
+        memset(&dircache[slot].mtime, 0, sizeof(struct timespec));
+        dircache[slot].path = strdup(path);
+    }
+
+    dircache[slot].lastuse = ++dircache_clock;
+    scanlisting(&dircache[slot], 1, NULL);
+
+    return &dircache[slot];
+}
+
+/**
+ * starts the indexer thread and asks it for the first index
+ * if there are no threads, updatecommands builds it itself.
+**/
+void startindexer() {
+    const char *cachehome = getvar("XDG_CACHE_HOME");
+    sigset_t blocked, saved;
+
+    /* set before the thread starts, it can't read the environment */
+    if (cachehome != NULL && cachehome[0] == '/') {
+        cmdcache_path = malloc(sizeof(char) * (strlen(cachehome) + 16));
+        sprintf(cmdcache_path, "%s/cbsh/commands", cachehome);
+    } else if (strcmp(homedir, "/")) {
+        cmdcache_path = malloc(sizeof(char) * (strlen(homedir) + 24));
+        sprintf(cmdcache_path, "%s/.cache/cbsh/commands", homedir);
+    }
+
+    /* signals are for the main thread */
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+    indexer_running = pthread_create(&indexer, NULL, indexer_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (indexer_running)
+        pthread_detach(indexer);
+    updatecommands();
+}
+
+/* the indexer thread, builds an index for every PATH it's given */
+void *indexer_main(void *arg) {
+    struct command_index *index;
+    char *pathenv;
+
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&indexer_lock);
+        while (indexer_path == NULL) {
+            pthread_cond_wait(&indexer_wake, &indexer_lock);
+        }
+        pathenv = indexer_path;
+        indexer_path = NULL;
+        pthread_mutex_unlock(&indexer_lock);
+
+        if ((index = buildcommands(pathenv)) != NULL)
+            atomic_store(&cmdindex_published, index);
+        free(pathenv);
+
+        /* after publishing, so the main thread sees the index before it asks again */
+        atomic_store(&indexer_busy, 0);
+    }
+    return NULL;
+}
+
+/**
+ * swaps in the index the indexer published, if any, and
+ * asks for a rescan unless one is running already.
+ * this never waits for the filesystem, unless there's no
+ * indexer thread.
+**/
+void updatecommands() {
+    const char *pathenv = getvar("PATH");
+    struct command_index *index;
+    int idle = !atomic_load(&indexer_busy);
+
+    if (!pathenv)
+        pathenv = "/usr/bin:/bin";
+
+    /* no thread, do it ourselves */
+    if (!indexer_running && (index = buildcommands(pathenv)) != NULL)
+        atomic_store(&cmdindex_published, index);
+
+    takecommands();
+
+    /* only ask again once the last index was taken, or one would overwrite the other */
+    if (indexer_running && idle) {
+        atomic_store(&indexer_busy, 1);
+        pthread_mutex_lock(&indexer_lock);
+        indexer_path = strdup(pathenv);
+        pthread_cond_signal(&indexer_wake);
+        pthread_mutex_unlock(&indexer_lock);
+    }
+}
+
+/**
+ * swaps in the index the indexer published, if there is one
+ * only called where nothing points into cmdindex.
+**/
+void takecommands() {
+    struct command_index *index;
+    int idx;
+
+    if ((index = atomic_exchange(&cmdindex_published, NULL)) == NULL)
+        return;
+
+    /* nothing points into the old index or what the new one retired anymore */
+    freecmdindex(cmdindex);
+    hash_indexok = -1;
+    for (idx = 0; idx < index->retired_c; idx++) {
+        free(index->retired[idx]);
+    }
+    free(index->retired);
+    index->retired = NULL;
+    index->retired_c = 0;
+    cmdindex = index;
+}
+
+/**
+ * function to build the command index
+ * the index is sorted by name and contains every
+ * name only once, so prefix lookups can binary search
+ * for the start of the matching range. for names that
+ * exist in multiple PATH dirs, the first dir wins, just
+ * like execvp would resolve it.
+ *
+ * every PATH dir keeps its own listing, which is only
+ * re-read if the dir's mtime changed. if nothing changed,
+ * this costs one stat per PATH dir and NULL is returned.
+ * runs on the indexer thread, the buffers of replaced
+ * listings are handed to the new index to be freed later.
+**/
+struct command_index *buildcommands(const char *pathenv) {
+    struct command_index *index;
+    int changed = 0, pathidx, old;
+
+    /* a new shell tries the cache before reading any dir */
+    if (pathdirs_env == NULL && (index = loadcmdcache(pathenv)) != NULL)
+        return index;
+
+    index = calloc(1, sizeof(struct command_index));
+
+    /* PATH itself changed, so match the new dirs up with the ones we already know */
+    if (pathdirs_env == NULL || strcmp(pathdirs_env, pathenv)) {
+        char *pathbuf = strdup(pathenv); /* this fixes a bug where we would overwrite PATH in the environment */
+        char **dirnames = NULL;
+        int count = 0;
+        dtmsplit(pathbuf, ":", &dirnames, &count);
+
+        struct dir_listing *newdirs = calloc(count + 1, sizeof(struct dir_listing));
+        for (pathidx = 0; pathidx < count; pathidx++) {
+            for (old = 0; old < pathdir_c; old++) {
+                if (pathdirs[old].path != NULL && !strcmp(pathdirs[old].path, dirnames[pathidx])) {
+                    newdirs[pathidx] = pathdirs[old];
+                    pathdirs[old].path = NULL; /* mark as taken over */
+                    break;
+                }
+            }
+            if (old == pathdir_c) {
+                newdirs[pathidx].path = strdup(dirnames[pathidx]);
+            }
+        }
+
+        /* drop the dirs that are no longer in PATH */
+        for (old = 0; old < pathdir_c; old++) {
+            if (pathdirs[old].path != NULL) {
+                retirelisting(&pathdirs[old], index);
+                free(pathdirs[old].path);
+            }
+        }
+        free(pathdirs);
+        free(dirnames);
+        free(pathbuf);
+
+        free(pathdirs_env);
+        pathdirs_env = strdup(pathenv);
+        pathdirs = newdirs;
+        pathdir_c = count;
+        changed = 1;
+    }
+
+    /* re-read every dir that changed since the last scan */
+    for (pathidx = 0; pathidx < pathdir_c; pathidx++) {
+        changed |= scanlisting(&pathdirs[pathidx], 0, index);
+    }
+
+    if (!changed && pathdirs_indexed) {
+        free(index);
+        return NULL;
+    }
+    pathdirs_indexed = 1;
+
+    /* add builtins */
+    size_t alloc_total = 0, idx;
+    for (pathidx = 0; pathidx < pathdir_c; pathidx++) {
+        alloc_total += pathdirs[pathidx].count;
+    }
+
+    struct command_entry *entries = malloc(sizeof(struct command_entry) * (alloc_total + NUM_BUILTINS));
+    alloc_total = 0;
+    for (idx = 0; idx < NUM_BUILTINS; idx++) {
+        entries[alloc_total].name = builtins[idx].name;
+        entries[alloc_total].dir = -1;
+        entries[alloc_total].builtin = 1;
+        alloc_total++;
+    }
+    for (pathidx = 0; pathidx < pathdir_c; pathidx++) {
+        for (idx = 0; idx < pathdirs[pathidx].count; idx++) {
+            entries[alloc_total].name = pathdirs[pathidx].list[idx];
+            entries[alloc_total].dir = pathidx;
+            entries[alloc_total].builtin = 0;
+            alloc_total++;
+        }
+    }
+
+    /* sort by name, then by PATH precedence (builtins first) */
+    qsort(entries, alloc_total, sizeof(struct command_entry), cmdentry_compare);
+
+    /* merge duplicates into the first entry of every name */
+    size_t read, write = 0;
+    for (read = 0; read < alloc_total; read++) {
+        if (write > 0 && !strcmp(entries[write - 1].name, entries[read].name)) {
+            if (entries[write - 1].dir == -1) {
+                entries[write - 1].dir = entries[read].dir;
+            }
+            continue;
+        }
+        entries[write++] = entries[read];
+    }
+
+    /* the index keeps its own copy of the dirs, pathdirs changes under it */
+    index->entries = entries;
+    index->count = write;
+    index->dirs = malloc(sizeof(char *) * (pathdir_c + 1));
+    for (index->dir_c = 0; index->dir_c < pathdir_c; index->dir_c++) {
+        index->dirs[index->dir_c] = strdup(pathdirs[index->dir_c].path);
+    }
+
+    savecmdcache(index);
+    return index;
+}
+
+/**
+ * loads the index for pathenv from the cache, if none of
+ * the dirs changed since it was written. the cache stays
+ * mapped for good, names in the index and the PATH
+ * listings point right into it.
+ * returns NULL if there is no usable cache.
+**/
+struct command_index *loadcmdcache(const char *pathenv) {
+    const struct cmdcache_header *header;
+    const struct cmdcache_dir *dirs;
+    const struct cmdcache_entry *entries;
+    const unsigned int *names;
+    struct stat st;
+    char *map;
+    size_t len, idx, end;
+    int fd, dir;
+
+    if (cmdcache_path == NULL || (fd = open(cmdcache_path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct cmdcache_header) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    len = st.st_size;
+    header = (const struct cmdcache_header *) map;
+
+    /* the strings are last, so a NUL at the end terminates all of them */
+    end = sizeof(struct cmdcache_header) + header->dir_c * sizeof(struct cmdcache_dir) +
+          (size_t) header->count * sizeof(struct cmdcache_entry) + (size_t) header->name_c * sizeof(unsigned int);
+    if (memcmp(header->magic, CMDCACHE_MAGIC, sizeof(header->magic)) || header->version != CMDCACHE_VERSION ||
+        header->builtins != builtinshash() || end > len || map[len - 1] != '\0' ||
+        header->path >= len || strcmp(map + header->path, pathenv))
+        goto stale;
+
+    dirs = (const struct cmdcache_dir *) (map + sizeof(struct cmdcache_header));
+    entries = (const struct cmdcache_entry *) (dirs + header->dir_c);
+    names = (const unsigned int *) (entries + header->count);
+
+    /* a few stats instead of reading every dir */
+    for (dir = 0; dir < (int) header->dir_c; dir++) {
+        struct timespec mtime = { 0, 0 };
+        if (dirs[dir].path < end || dirs[dir].path >= len || (size_t) dirs[dir].first + dirs[dir].count > header->name_c)
+            goto stale;
+        if (!stat(map + dirs[dir].path, &st) && S_ISDIR(st.st_mode))
+            mtime = st.st_mtim;
+        if (mtime.tv_sec != dirs[dir].sec || mtime.tv_nsec != dirs[dir].nsec)
+            goto stale;
+    }
+    for (idx = 0; idx < header->name_c; idx++) {
+        if (names[idx] <= end || names[idx] >= len)
+            goto stale;
+    }
+    for (idx = 0; idx < header->count; idx++) {
+        if (entries[idx].name <= end || entries[idx].name >= len || entries[idx].dir < -1 || entries[idx].dir >= (int) header->dir_c)
+            goto stale;
+    }
+
+    /* the listings, so a dir that changes later doesn't mean reading all the others */
+    pathdirs = calloc(header->dir_c + 1, sizeof(struct dir_listing));
+    pathdir_c = header->dir_c;
+    for (dir = 0; dir < pathdir_c; dir++) {
+        pathdirs[dir].path = strdup(map + dirs[dir].path);
+        pathdirs[dir].mtime.tv_sec = dirs[dir].sec;
+        pathdirs[dir].mtime.tv_nsec = dirs[dir].nsec;
+        pathdirs[dir].list = malloc(sizeof(char *) * (dirs[dir].count + 1));
+        for (pathdirs[dir].count = 0; pathdirs[dir].count < dirs[dir].count; pathdirs[dir].count++) {
+            pathdirs[dir].list[pathdirs[dir].count] = map + names[dirs[dir].first + pathdirs[dir].count];
+        }
+    }
+    pathdirs_env = strdup(pathenv);
+    pathdirs_indexed = 1;
+
+    struct command_index *index = calloc(1, sizeof(struct command_index));
+    index->entries = malloc(sizeof(struct command_entry) * (header->count + 1));
+    for (index->count = 0; index->count < header->count; index->count++) {
+        index->entries[index->count].name = map + entries[index->count].name;
+        index->entries[index->count].dir = entries[index->count].dir;
+        index->entries[index->count].builtin = entries[index->count].builtin;
+    }
+    index->dirs = malloc(sizeof(char *) * (pathdir_c + 1));
+    for (index->dir_c = 0; index->dir_c < pathdir_c; index->dir_c++) {
+        index->dirs[index->dir_c] = strdup(pathdirs[index->dir_c].path);
+    }
+    return index;
+
+stale:
+    munmap(map, len);
+    return NULL;
+}
+
+/**
+ * writes index and the PATH listings it was built from to
+ * the cache. it's written to a temporary file and renamed,
+ * so other shells only ever see a whole cache.
+**/
+void savecmdcache(const struct command_index *index) {
+    struct cmdcache_header header;
+    struct cmdcache_dir *dirs;
+    struct cmdcache_entry *entries;
+    unsigned int *names, *builtin_names, offset;
+    char *tmppath, *slash;
+    size_t idx, name_c = 0, tmplen;
+    int fd, dir;
+    FILE *cache;
+
+    if (cmdcache_path == NULL)
+        return;
+
+    /* the path with the .XXXXXX mkstemp fills in */
+    tmplen = snprintf(NULL, 0, "%s.XXXXXX", cmdcache_path) + 1;
+    if ((tmppath = malloc(sizeof(char) * tmplen)) == NULL)
+        return;
+
+    /* make the dir, and ~/.cache if it has to be */
+    snprintf(tmppath, tmplen, "%s", cmdcache_path);
+    for (slash = strchr(tmppath + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(tmppath, 0700);
+        *slash = '/';
+    }
+    snprintf(tmppath, tmplen, "%s.XXXXXX", cmdcache_path);
+    if ((fd = mkstemp(tmppath)) == -1 || (cache = fdopen(fd, "w")) == NULL) {
+        if (fd != -1)
+            close(fd);
+        free(tmppath);
+        return;
+    }
+
+    for (dir = 0; dir < pathdir_c; dir++) {
+        name_c += pathdirs[dir].count;
+    }
+
+    /* lay the strings out first, everything else points at them */
+    memset(&header, 0, sizeof(struct cmdcache_header));
+    strcpy(header.magic, CMDCACHE_MAGIC);
+    header.version = CMDCACHE_VERSION;
+    header.builtins = builtinshash();
+    header.dir_c = pathdir_c;
+    header.count = index->count;
+    header.name_c = name_c;
+
+    dirs = calloc(pathdir_c + 1, sizeof(struct cmdcache_dir));
+    entries = calloc(index->count + 1, sizeof(struct cmdcache_entry));
+    names = malloc(sizeof(unsigned int) * (name_c + 1));
+    builtin_names = malloc(sizeof(unsigned int) * NUM_BUILTINS);
+
+    offset = sizeof(struct cmdcache_header) + pathdir_c * sizeof(struct cmdcache_dir) +
+             index->count * sizeof(struct cmdcache_entry) + name_c * sizeof(unsigned int);
+    header.path = offset;
+    offset += strlen(pathdirs_env) + 1;
+    for (dir = 0, name_c = 0; dir < pathdir_c; dir++) {
+        dirs[dir].sec = pathdirs[dir].mtime.tv_sec;
+        dirs[dir].nsec = pathdirs[dir].mtime.tv_nsec;
+        dirs[dir].path = offset;
+        dirs[dir].first = name_c;
+        dirs[dir].count = pathdirs[dir].count;
+        offset += strlen(pathdirs[dir].path) + 1;
+        for (idx = 0; idx < pathdirs[dir].count; idx++) {
+            names[name_c++] = offset + 1;
+            offset += strlen(pathdirs[dir].list[idx]) + 2;
+        }
+    }
+    for (idx = 0; idx < NUM_BUILTINS; idx++) {
+        builtin_names[idx] = offset + 1;
+        offset += strlen(builtins[idx].name) + 2;
+    }
+
+    /* the index points at the same names, found by a binary search in their dir */
+    for (idx = 0; idx < index->count; idx++) {
+        const struct command_entry *entry = &index->entries[idx];
+        entries[idx].dir = entry->dir;
+        entries[idx].builtin = entry->builtin;
+        if (entry->builtin) {
+            entries[idx].name = builtin_names[findbuiltin(entry->name) - builtins];
+        } else {
+            const struct dir_listing *listing = &pathdirs[entry->dir];
+            entries[idx].name = names[dirs[entry->dir].first + listing_lowerbound(listing, entry->name, strlen(entry->name) + 1)];
+        }
+    }
+
+    fwrite(&header, sizeof(struct cmdcache_header), 1, cache);
+    fwrite(dirs, sizeof(struct cmdcache_dir), pathdir_c, cache);
+    fwrite(entries, sizeof(struct cmdcache_entry), index->count, cache);
+    fwrite(names, sizeof(unsigned int), name_c, cache);
+    fwrite(pathdirs_env, 1, strlen(pathdirs_env) + 1, cache);
+    for (dir = 0; dir < pathdir_c; dir++) {
+        fwrite(pathdirs[dir].path, 1, strlen(pathdirs[dir].path) + 1, cache);
+        for (idx = 0; idx < pathdirs[dir].count; idx++) {
+            fputc(pathdirs[dir].list[idx][-1], cache);
+            fwrite(pathdirs[dir].list[idx], 1, strlen(pathdirs[dir].list[idx]) + 1, cache);
+        }
+    }
+    for (idx = 0; idx < NUM_BUILTINS; idx++) {
+        fputc(DT_UNKNOWN, cache);
+        fwrite(builtins[idx].name, 1, strlen(builtins[idx].name) + 1, cache);
+    }
+
+    if (fclose(cache) == 0) {
+        rename(tmppath, cmdcache_path);
+    } else {
+        unlink(tmppath);
     }
+    free(tmppath);
+    free(dirs);
+    free(entries);
+    free(names);
+    free(builtin_names);
 }
 
-/**
- * splits str at delim into array with length elements
-**/
-void dtmsplit(char *str, char *delim, char ***array, int *length) {
-    int i = 0;
-    char *token;
-    char **res = malloc(sizeof(char *) * 2);
+/* hashes the names of all builtins, to tell caches from other builds apart */
+unsigned int builtinshash() {
+    unsigned int hash = 0;
+    size_t idx;
 
-    /* get the first token */
-    token = strtok(str, delim);
-    while (token != NULL) {
-        res = (char **) realloc(res, (i + 2) * sizeof(char *));
-        res[i] = token;
-        token = strtok(NULL, delim);
-        i++;
+    for (idx = 0; idx < NUM_BUILTINS; idx++) {
+        hash = strhash(builtins[idx].name, hash);
     }
+    return hash;
+}
 
-    *array = res;
-    *length = i;
+/* hands the buffers of listing to index, to be freed once the index before it is gone */
+void retirelisting(struct dir_listing *listing, struct command_index *index) {
+    if (listing->names == NULL && listing->list == NULL)
+        return;
+    index->retired = realloc(index->retired, sizeof(void *) * (index->retired_c + 2));
+    index->retired[index->retired_c++] = listing->names;
+    index->retired[index->retired_c++] = listing->list;
+    listing->names = NULL;
+    listing->list = NULL;
+    listing->count = 0;
+}
+
+/* free a command index, along with the buffers it retired */
+void freecmdindex(struct command_index *index) {
+    int idx;
+
+    if (index == &cmdindex_empty)
+        return;
+    for (idx = 0; idx < index->dir_c; idx++) {
+        free(index->dirs[idx]);
+    }
+    for (idx = 0; idx < index->retired_c; idx++) {
+        free(index->retired[idx]);
+    }
+    free(index->retired);
+    free(index->dirs);
+    free(index->entries);
+    free(index);
 }
 
 /**
- * parses str with shell syntax
- *
- * NEW PARSER! now uses a char-by-char
- * seek-ahead parser because, while an
- * action-on-token back-looking parser
- * may be faster, it is significantly
- * more difficult to write and harder
- * to read.
-**/
-void dtmparse(char *str, char ***array, int *length) {
-    int i = 0, i_alloc = 2, in_quotes = 0, maxlen = strlen(str), k = 0, helper = 0, str_alloc = maxlen + 1, str_alloc_step = 32, str_pos = 0;
-    int *res = malloc(sizeof(int) * 3);
-    char *str_new = malloc(sizeof(char) * (str_alloc));
-
-    /* first pass: parse with relative offsets */
-    res[i] = str_pos;
-    for (; k <= maxlen; k++) {
-        switch (str[k]) {
-            case '$':
-                if (str[k + 1] == '(') {
-                    // TODO
-                } else if (str[k + 1] == '"' || str[k + 1] == '\'') {
-                    break;
-                } else if (str[k + 1] == '{') {
-                    /* seek to closing bracket */
-                    for (helper = k; str[helper] != '}' && helper <= maxlen; helper++);
+ * re-reads a dir listing if the dir's mtime changed
+ * if escape is set, spaces in names are escaped so
+ * they can be completed into a command line. if retire
+ * is set, the old buffers go there instead of being freed.
+ * returns 1 if the listing changed, 0 if not
+**/
+int scanlisting(struct dir_listing *listing, int escape, struct command_index *retire) {
+    struct stat st;
+    struct timespec mtime = { 0, 0 };
 
-                    /* check syntax validity */
-                    if (str[helper] != '}') {
-                        panic("syntax error", "unclosed curly braces found\n");
-                        free(res);
-                        free(str_new);
-                        *array = NULL;
-                        *length = 0;
-                        return;
-                    }
+    /* dirs that don't exist are treated like empty ones */
+    if (!stat(listing->path, &st) && S_ISDIR(st.st_mode)) {
+        mtime = st.st_mtim;
+    }
 
-                    /* terminate var name string */
-                    str[helper] = '\0';
+    if (mtime.tv_sec == listing->mtime.tv_sec && mtime.tv_nsec == listing->mtime.tv_nsec)
+        return 0;
 
-                    /* we null-terminated the segment, so this is fine */
-                    char *envvar = getenv(str + k + 2);
+    listing->mtime = mtime;
+    if (retire != NULL)
+        retirelisting(listing, retire);
+    free(listing->names);
+    free(listing->list);
+    listing->names = NULL;
+    listing->list = NULL;
+    listing->count = 0;
 
-                    k = helper;
+    DIR *dir = opendir(listing->path);
+    if (dir == NULL) {
+        return 1;
+    }
 
-                    if (envvar) {
-                        int lenvvar = strlen(envvar); // haha funny pun
-                        /* make sure we have enough bytes */
-                        if (str_pos + lenvvar >= str_alloc - 3) {
-                            str_new = realloc(str_new, sizeof(char) * (str_alloc + lenvvar + 2));
-                            str_alloc = str_alloc + lenvvar + 2;
-                        }
+    /* copy all names into one buffer, remember offsets since realloc moves memory */
+    struct dirent *dent;
+    size_t names_alloc = 4096, names_len = 0, offs_alloc = 256, count = 0, namelen;
+    size_t *offsets = malloc(sizeof(size_t) * offs_alloc);
+    char *names = malloc(sizeof(char) * names_alloc);
 
-                        /* simple strcpy */
-                        for (helper = 0; helper < lenvvar; helper++) {
-                            str_new[str_pos++] = envvar[helper];
-                        }
-                    } else {
-#ifdef DEBUG_OUTPUT
-                        panic("getenv", "variable not found in environment\n");
-#endif
-                        break;
-                    }
-                } else {
-                    /* seek to terminating special char */
-                    for (helper = k + 1; helper < maxlen &&
-                             str[helper] != '}' &&
-                             str[helper] != '"' &&
-                             str[helper] != '\'' &&
-                             str[helper] != '$' &&
-                             str[helper] != ' ' &&
-                             str[helper] != '\\' &&
-                             str[helper] != '='; helper++);
-
-                    /* terminate var name string */
-                    char tmp = str[helper];
-                    str[helper] = '\0';
-
-                    /* we null-terminated the segment, so this is fine */
-                    char *envvar = getenv(str + k + 1);
-
-                    k = helper - 1;
-                    str[helper] = tmp;
-
-                    if (envvar) {
-                        int lenvvar = strlen(envvar); // haha funny pun
-                        /* make sure we have enough bytes */
-                        if (str_pos + lenvvar >= str_alloc - 3) {
-                            str_new = realloc(str_new, sizeof(char) * (str_alloc + lenvvar + 2));
-                            str_alloc = str_alloc + lenvvar + 2;
-                        }
+    while ((dent = readdir(dir)) != NULL) {
+        /* skip . and .. */
+        if (dent->d_name[0] == '.' && (dent->d_name[1] == '\0' || (dent->d_name[1] == '.' && dent->d_name[2] == '\0')))
+            continue;
 
-                        /* simple strcpy */
-                        for (helper = 0; helper < lenvvar; helper++) {
-                            str_new[str_pos++] = envvar[helper];
-                        }
-                    } else {
-#ifdef DEBUG_OUTPUT
-                        panic("getenv", "variable not found in environment\n");
-#endif
-                        break;
-                    }
-                }
-                break;
-            case ' ':
-                /* make sure we have enough bytes */
-                if (str_pos >= str_alloc - 2) {
-                    str_new = realloc(str_new, sizeof(char) * (str_alloc + str_alloc_step));
-                    str_alloc = str_alloc + str_alloc_step;
-                }
+        namelen = strlen(dent->d_name) + 2;
+        if (escape)
+            namelen += countchar(dent->d_name, ' ');
 
-                if (!in_quotes) {
-                    /* don't parse empty arguments */
-                    if (str_new[str_pos - 1] != '\0') {
-                        str_new[str_pos++] = '\0';
-                        res[++i] = str_pos;
-                    }
-                } else {
-                    str_new[str_pos++] = ' ';
-                }
-                break;
-            case '\'':
-                if (in_quotes == 1) {
-                    /* make sure we have enough bytes */
-                    if (str_pos >= str_alloc - 2) {
-                        str_new = realloc(str_new, sizeof(char) * (str_alloc + str_alloc_step));
-                        str_alloc = str_alloc + str_alloc_step;
-                    }
-                    /* just copy the char */
-                    str_new[str_pos++] = str[k];
-                } else if (in_quotes == 2) {
-                    in_quotes = 0;
-                } else {
-                    in_quotes = 2;
-                }
-                break;
-            case '"':
-                if (in_quotes == 2) {
-                    /* make sure we have enough bytes */
-                    if (str_pos >= str_alloc - 2) {
-                        str_new = realloc(str_new, sizeof(char) * (str_alloc + str_alloc_step));
-                        str_alloc = str_alloc + str_alloc_step;
-                    }
-                    /* just copy the char */
-                    str_new[str_pos++] = str[k];
-                } else if (in_quotes == 1) {
-                    in_quotes = 0;
-                } else {
-                    in_quotes = 1;
-                }
-                break;
-            case '\\':
-                /* ignore this char and skip to the next one */
-                k++;
-                __attribute__ ((fallthrough));
-            default:
-                /* make sure we have enough bytes */
-                if (str_pos >= str_alloc - 2) {
-                    str_new = realloc(str_new, sizeof(char) * (str_alloc + str_alloc_step));
-                    str_alloc = str_alloc + str_alloc_step;
-                }
-                /* just copy the char if it has no special meaning */
-                str_new[str_pos++] = str[k];
-                break;
+        if (names_len + namelen > names_alloc) {
+            names_alloc = (names_alloc + namelen) * 2;
+            names = realloc(names, sizeof(char) * names_alloc);
         }
-        if (i >= i_alloc) {
-            res = realloc(res, sizeof(int) * (i + 3));
-            i_alloc += 2;
+        if (count >= offs_alloc) {
+            offs_alloc *= 2;
+            offsets = realloc(offsets, sizeof(size_t) * offs_alloc);
+        }
+        /* the type goes in front, completing cd only wants dirs */
+        names[names_len++] = dent->d_type;
+        offsets[count++] = names_len;
+
+        if (escape) {
+            /* strcpy with escaping, yay */
+            int pos;
+            for (pos = 0; dent->d_name[pos] != '\0'; pos++) {
+                if (dent->d_name[pos] == ' ')
+                    names[names_len++] = '\\';
+                names[names_len++] = dent->d_name[pos];
+            }
+            names[names_len++] = '\0';
+        } else {
+            memcpy(names + names_len, dent->d_name, namelen - 1);
+            names_len += namelen - 1;
         }
     }
+    closedir(dir);
 
-    /* fix: skip empty args at end */
-    if (str_new[str_pos - 2] == '\0') {
-        i--;
-    }
-
-    /* check for quote termination */
-    if (in_quotes) {
-        panic("syntax error", "unterminated quote found\n");
-        free(res);
-        free(str_new);
-        *array = NULL;
-        *length = 0;
-        return;
+    listing->names = names;
+    listing->list = malloc(sizeof(char *) * (count + 1));
+    for (listing->count = 0; listing->count < count; listing->count++) {
+        listing->list[listing->count] = names + offsets[listing->count];
     }
+    free(offsets);
 
-    /* second pass: convert relative offsets to actual addresses
-                    because realloc moves memory */
-    char **res_final = malloc(sizeof(char *) * (i + 2));
-    for (k = 0; k <= i; k++) {
-        res_final[k] = str_new + res[k];
-    }
-    free(res);
+    qsort(listing->list, listing->count, sizeof(char *), namecompare);
 
-    *array = res_final;
-    *length = i + 1;
+    return 1;
 }
 
-/* function to build the hints array */
-void buildhints(char const *targetdir) {
-    struct dirent *dent;
-    DIR *dir = opendir(targetdir);
-    if (dir == NULL) {
-        perror("opendir");
-    }
+/* returns the position of the first name in listing that sorts >= prefix */
+size_t listing_lowerbound(const struct dir_listing *listing, const char *prefix, size_t prefixlen) {
+    size_t low = 0, high = listing->count, mid;
 
-    /* prevent memory leak when chdir'ing a lot */
-    if (files != NULL) {
-        int fileidx = 0;
-        while (files[fileidx] != NULL) {
-            free(files[fileidx++]);
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (strncmp(listing->list[mid], prefix, prefixlen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        free(files);
     }
 
-    int alloc_current = 128, alloc_step = 64;
-    files = malloc(sizeof(char *) * alloc_current);
+    return low;
+}
+
+/* free a dir listing */
+void freelisting(struct dir_listing *listing) {
+    free(listing->path);
+    free(listing->names);
+    free(listing->list);
+    listing->path = NULL;
+    listing->names = NULL;
+    listing->list = NULL;
+    listing->count = 0;
+}
 
-    int dent_i = 0;
-    while ((dent = readdir(dir)) != NULL) {
-        files[dent_i] = malloc(sizeof(char) * (strlen(dent->d_name) + 2 + countchar(dent->d_name, ' ')));
-
-        /* strcpy with escaping, yay */
-        int pos, outpos = 0;
-        for (pos = 0; dent->d_name[pos] != '\0'; pos++, outpos++) {
-            /* maybe this gets optimized? need to check perf later. */
-            switch (dent->d_name[pos]) {
-                case ' ':
-                    files[dent_i][outpos++] = '\\';
-                    __attribute__ ((fallthrough));
-                default:
-                    files[dent_i][outpos] = dent->d_name[pos];
-            }
-        }
-        files[dent_i][outpos] = '\0';
+/* qsort comparator for arrays of strings */
+int namecompare(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/* qsort comparator for the command index */
+int cmdentry_compare(const void *a, const void *b) {
+    const struct command_entry *ea = a, *eb = b;
+    int cmp = strcmp(ea->name, eb->name);
 
-        dent_i++;
+    if (cmp)
+        return cmp;
+    return (ea->dir > eb->dir) - (ea->dir < eb->dir);
+}
+
+/* returns the position of the first command that sorts >= prefix */
+size_t cmdindex_lowerbound(const char *prefix, size_t prefixlen) {
+    size_t low = 0, high = cmdindex->count, mid;
 
-        if (dent_i >= alloc_current) {
-            alloc_current += alloc_step;
-            files = realloc(files, sizeof(char *) * alloc_current);
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (strncmp(cmdindex->entries[mid].name, prefix, prefixlen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    files[dent_i] = NULL;
 
-    closedir(dir);
+    return low;
 }
 
-/* function to build the commands array */
-void buildcommands() {
-    char *pathent = getenv("PATH");
-    pathent = strdup(pathent); /* this fixes a bug where we would overwrite PATH in the environment */
-    if (!pathent) {
-        pathent = malloc(sizeof(char) * 14);
-        strcpy(pathent, "/usr/bin:/bin");
-    }
-
-    /* get array of dirs in PATH */
-    char **pathdirs = NULL;
-    int count = 0;
-    dtmsplit(pathent, ":", &pathdirs, &count);
-    pathdirs[count] = NULL;
-
-    /* higher alloc step because PATH will probably contain a lot more files than your average directory */
-    int alloc_current = 256, alloc_step = 128, alloc_total = 0;
-    commands = malloc(sizeof(char *) * alloc_current);
-
-    /* iterate though every dir in path */
-    int pathidx = 0;
-    while (pathdirs[pathidx] != NULL) {
-        struct dirent *dent;
-        DIR *dir = opendir(pathdirs[pathidx]);
-        if (dir == NULL) {
-            perror("opendir");
-            fprintf(stderr, "\npath: %s\n", pathdirs[pathidx]);
-        }
-
-        while ((dent = readdir(dir)) != NULL) {
-            commands[alloc_total++] = strdup(dent->d_name);
-            if (alloc_total >= alloc_current) {
-                alloc_current += alloc_step;
-                commands = realloc(commands, sizeof(char *) * alloc_current);
-            }
-            /* only read first 32768 files (keep mem footprint small) */
-            if (alloc_total > 32768) {
-                fprintf(stderr, "WARN: too big alloc because too many files in PATH\n");
-                return;
-            }
-        }
+/* looks up name in the command index, returns NULL if not found */
+const struct command_entry *cmdindex_find(const char *name) {
+    size_t pos = cmdindex_lowerbound(name, strlen(name) + 1);
 
-        closedir(dir);
-        pathidx++;
-    }
+    if (pos < cmdindex->count && !strcmp(cmdindex->entries[pos].name, name))
+        return &cmdindex->entries[pos];
+    return NULL;
+}
 
-    /* add builtins */
-    if (alloc_total + NUM_BUILTINS > alloc_current) {
-        alloc_current += NUM_BUILTINS;
-        commands = realloc(commands, sizeof(char *) * alloc_current);
+/**
+ * resolves name to its full path in PATH using the
+ * command index, so we don't have to let execvp
+ * try every single PATH dir.
+ * returns 1 on success, 0 if name is not indexed
+**/
+int cmdindex_resolve(const char *name, char *path, size_t pathlen) {
+    const struct command_entry *entry = cmdindex_find(name);
+
+    if (entry == NULL || entry->dir == -1)
+        return 0;
+
+    return snprintf(path, pathlen, "%s/%s", cmdindex->dirs[entry->dir], name) < (int) pathlen;
+}
+
+/**
+ * checks if cmdindex was built for the PATH we have now
+ * the result is kept until PATH or the index changes.
+**/
+int cmdindex_current() {
+    const char *pathenv = getvar("PATH"), *dir;
+    size_t len;
+    int idx = 0;
+
+    if (var_overlay != NULL && overlayvalue("PATH") != NULL)
+        return 0;
+    if (hash_indexok != -1)
+        return hash_indexok;
+    if (!pathenv)
+        pathenv = "/usr/bin:/bin";
+
+    /* empty PATH entries aren't indexed */
+    hash_indexok = 0;
+    for (dir = pathenv; *dir != '\0'; dir += len + (dir[len] == ':')) {
+        if ((len = strcspn(dir, ":")) == 0)
+            continue;
+        if (idx >= cmdindex->dir_c || strncmp(cmdindex->dirs[idx], dir, len) || cmdindex->dirs[idx][len] != '\0')
+            return 0;
+        idx++;
     }
-    commands[alloc_total++] = "cd";
-    commands[alloc_total++] = "chdir";
-    commands[alloc_total++] = "exit";
-    commands[alloc_total++] = "export";
-    commands[alloc_total++] = "setenv";
-    commands[alloc_total++] = "getenv";
-    commands[alloc_total++] = "builtin";
-    commands[alloc_total++] = "command";
-    commands[alloc_total++] = "echo";
-    commands[alloc_total++] = "logout";
-    commands[alloc_total++] = ":";
-    commands[alloc_total++] = ".";
-    commands[alloc_total++] = "source";
-    commands[alloc_total++] = "alias";
-    commands[alloc_total++] = "unalias";
+    hash_indexok = idx == cmdindex->dir_c;
+    return hash_indexok;
+}
+
+/**
+ * walks PATH for name, like execvp does
+ * returns 1 if it was found, 0 if not
+**/
+int searchpath(const char *name, char *path, size_t pathlen) {
+    const char *pathenv = getvar("PATH"), *dir;
+    struct stat st;
+    size_t len;
+
+    if (!pathenv)
+        pathenv = "/usr/bin:/bin";
+
+    for (dir = pathenv;; dir += len + 1) {
+        len = strcspn(dir, ":");
+
+        /* an empty entry is the current dir */
+        if (snprintf(path, pathlen, "%.*s%s%s", (int) len, dir, len ? "/" : "", name) < (int) pathlen
+                && !stat(path, &st) && S_ISREG(st.st_mode) && !access(path, X_OK))
+            return 1;
 
-    /* add aliases */
-    if (alloc_total + alias_c + function_c > (unsigned)alloc_current) {
-        alloc_current += (alias_c + function_c);
-        commands = realloc(commands, sizeof(char *) * alloc_current);
+        if (dir[len] == '\0')
+            return 0;
     }
-    unsigned int idx;
-    for (idx = 0; idx < alias_c; idx++) {
-        commands[alloc_total++] = aliases[idx]->alias;
+}
+
+/* looks up name in the hash table */
+struct command_hash *findhash(const char *name) {
+    struct command_hash *entry;
+
+    for (entry = hash_table[strhash(name, 0) & (HASH_BUCKETS - 1)]; entry; entry = entry->next) {
+        if (!strcmp(entry->name, name))
+            return entry;
     }
-    for (idx = 0; idx < function_c; idx++) {
-        commands[alloc_total++] = functions[idx]->name;
+
+    return NULL;
+}
+
+/**
+ * finds where name is in PATH, the first time
+ * from the command index if it is up to date or
+ * by walking PATH, then from the hash table.
+ * returns NULL if name is nowhere in PATH
+**/
+struct command_hash *resolvehash(const char *name) {
+    struct command_hash *entry = findhash(name);
+    char path[MAXCURDIRLEN];
+
+    if (entry)
+        return entry;
+
+    if ((cmdindex_current() && cmdindex_resolve(name, path, MAXCURDIRLEN)) || searchpath(name, path, MAXCURDIRLEN))
+        return sethash(name, path);
+    return NULL;
+}
+
+/* remembers path for name, replacing what was there */
+struct command_hash *sethash(const char *name, const char *path) {
+    struct command_hash *entry = calloc(1, sizeof(struct command_hash));
+
+    forgethash(name);
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->next = hash_table[strhash(name, 0) & (HASH_BUCKETS - 1)];
+    hash_table[strhash(name, 0) & (HASH_BUCKETS - 1)] = entry;
+
+    return entry;
+}
+
+/* forgets where name is, returns -1 if it wasn't known */
+int forgethash(const char *name) {
+    struct command_hash **link = &hash_table[strhash(name, 0) & (HASH_BUCKETS - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        if (!strcmp((*link)->name, name)) {
+            struct command_hash *entry = *link;
+
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return 0;
+        }
     }
 
+    return -1;
+}
+
+/* forgets everything, for when PATH changed */
+void clearhash() {
+    int bucket;
 
-    /* correctly terminate array */
-    commands[alloc_total] = NULL;
+    for (bucket = 0; bucket < HASH_BUCKETS; bucket++) {
+        while (hash_table[bucket]) {
+            forgethash(hash_table[bucket]->name);
+        }
+    }
+    hash_indexok = -1;
 }
 
 /* check if str starts with prefix */
@@ -943,121 +5691,449 @@ int countchar(const char *haystack, const char needle) {
     return count;
 }
 
-/* hints */
-char *hints(const char *buf, int *color, int *bold) {
-    /* finds the last element of buf, delimited by spaces */
-    char *lastbuf = strdup(buf), *lastarg = lastbuf;
-    int bufidx = 0;
+/**
+ * counts the command line starts with for ranking
+ * completions, every line the history sees is counted,
+ * including the ones loaded from the log.
+**/
+void recordusage(const char *line) {
+    struct command_usage *usage;
+    char name[256];
+    size_t len;
+
+    usage_clock++;
+    line += strspn(line, " \t");
+    if ((len = strcspn(line, " \t;|&<>()")) == 0 || len >= sizeof(name))
+        return;
+    memcpy(name, line, len);
+    name[len] = '\0';
+
+    unsigned int bucket = strhash(name, 0) & (USAGE_BUCKETS - 1);
+    for (usage = usage_table[bucket]; usage != NULL && strcmp(usage->name, name); usage = usage->next);
+    if (usage == NULL) {
+        usage = calloc(1, sizeof(struct command_usage));
+        usage->name = strdup(name);
+        usage->next = usage_table[bucket];
+        usage_table[bucket] = usage;
+    }
+    usage->count++;
+    usage->last = usage_clock;
+}
+
+/**
+ * returns the bonus name gets for having been run,
+ * up to 256 for how often and 200 for how recently
+**/
+int usagescore(const char *name) {
+    const struct command_usage *usage;
+    unsigned long age;
 
-    while (lastarg[0] == ' ') {
-        lastarg = ++lastbuf;
+    for (usage = usage_table[strhash(name, 0) & (USAGE_BUCKETS - 1)]; usage != NULL; usage = usage->next) {
+        if (!strcmp(usage->name, name))
+            break;
+    }
+    if (usage == NULL)
+        return 0;
+
+    age = usage_clock - usage->last;
+    return (usage->count < 64 ? usage->count : 64) * 4 +
+           (age < 8 ? 200 : age < 64 ? 100 : age < 512 ? 40 : 0);
+}
+
+/**
+ * scores how well name matches what was typed
+ * prefix matches score 1500 to 2000, shorter names first.
+ * otherwise, word has to be a subsequence of name, which
+ * scores below 1500, more for runs and matches after a
+ * separator, less for skipped chars. returns -1 if name
+ * doesn't match at all.
+**/
+int matchscore(const char *name, const char *word, size_t wordlen) {
+    size_t namelen, matched = 0, pos;
+    int score = 1000, run = 0;
+
+    if (!strncmp(name, word, wordlen)) {
+        namelen = strlen(name) - wordlen;
+        return 2000 - (namelen < 500 ? (int) namelen : 500);
     }
 
-    while ((lastbuf = strstr(lastbuf, " ")) != NULL) {
-        lastarg = ++lastbuf;
-        bufidx++;
-        if (strlen(lastarg) < 2)
+    for (pos = 0; name[pos] != '\0' && matched < wordlen; pos++) {
+        if (name[pos] != word[matched]) {
+            score -= 3;
+            run = 0;
             continue;
-        if (!strncmp(lastarg, "&& ", 3) || !strncmp(lastarg, "|| ", 3)) {
-            bufidx = -1;
-        } else if (lastarg[0] == ';') {
-            bufidx = -(lastarg[1] == ' ');
-            lastarg++;
-        } else if (*(lastarg - 2) == ';') {
-            bufidx = 0;
         }
+        if (pos == 0 || strchr("-_./ ", name[pos - 1]) != NULL)
+            score += 15;
+        score += run * 10;
+        run++;
+        matched++;
     }
+    if (matched < wordlen)
+        return -1;
 
-    if (lastarg[0] == '\0') {
-        free(lastbuf);
-        return NULL;
+    score -= strlen(name + pos);
+    return score < 1 ? 1 : score > 1499 ? 1499 : score;
+}
+
+/* returns whether a ranks below b, ties go alphabetically */
+int candidate_worse(const struct candidate *a, const struct candidate *b) {
+    return a->score < b->score || (a->score == b->score && strcmp(a->name, b->name) > 0);
+}
+
+/* moves the candidate at pos down until the heap is in order */
+void siftcandidate(struct candidate_heap *heap, int pos) {
+    struct candidate *items = heap->items, tmp;
+    int child;
+
+    for (; (child = pos * 2 + 1) < heap->count; pos = child) {
+        if (child + 1 < heap->count && candidate_worse(&items[child + 1], &items[child]))
+            child++;
+        if (!candidate_worse(&items[child], &items[pos]))
+            break;
+        tmp = items[pos];
+        items[pos] = items[child];
+        items[child] = tmp;
+    }
+}
+
+/**
+ * keeps candidate if it's one of the best limit ones so far
+ * nothing is allocated, names are stored as they are.
+**/
+void offercandidate(struct candidate_heap *heap, const char *name, int score, int color, const struct dir_listing *listing) {
+    struct candidate offer = { name, score, color, listing };
+    int pos;
+
+    if (heap->count < heap->limit) {
+        for (pos = heap->count++; pos > 0 && candidate_worse(&offer, &heap->items[(pos - 1) / 2]); pos = (pos - 1) / 2) {
+            heap->items[pos] = heap->items[(pos - 1) / 2];
+        }
+        heap->items[pos] = offer;
+    } else if (heap->count > 0 && candidate_worse(&heap->items[0], &offer)) {
+        /* replaces the worst one */
+        heap->items[0] = offer;
+        siftcandidate(heap, 0);
     }
+}
 
-    /* if we're in the first argument of a command, also autocomplete from the list of commands in PATH */
-    if (bufidx == 0) {
-        int cmdidx = 0;
-        while (commands[cmdidx] != NULL) {
-            if (startswith(commands[cmdidx], lastarg)) {
-                *color = 32;
-                *bold = 0;
-                free(lastbuf);
-                return (commands[cmdidx] + strlen(lastarg));
+/**
+ * finds the word at the end of buf and what it is
+ * quoting and escapes work like in dtmparse, but nothing
+ * is expanded, as a hint must never run a $( ).
+ * returns 0 if there is nothing to complete.
+**/
+int completioncontext(const char *buf, struct completion_context *ctx) {
+    size_t pos, cmdstart = 0, cmdlen = 0, slash = 0, dirlen = 0;
+    int in_quotes = 0, inword = 0, argidx = 0;
+
+    ctx->start = 0;
+    for (pos = 0; buf[pos] != '\0'; pos++) {
+        if (!in_quotes && strchr(" \t;|&<>()", buf[pos]) != NULL) {
+            if (inword && argidx++ == 0) {
+                cmdstart = ctx->start;
+                cmdlen = pos - ctx->start;
             }
-            cmdidx++;
+            if (strchr(";|&()", buf[pos]) != NULL)
+                argidx = cmdlen = 0;
+            inword = 0;
+            continue;
         }
-    }
 
-    int fileidx = 0;
-    while (files[fileidx] != NULL) {
-        if (startswith(files[fileidx], lastarg)) {
-            *color = 35;
-            *bold = 0;
-            free(lastbuf);
-            return (files[fileidx] + strlen(lastarg));
+        if (!inword) {
+            inword = 1;
+            ctx->start = pos;
+        }
+        if (in_quotes == 2) {
+            in_quotes = buf[pos] == '\'' ? 0 : 2;
+        } else if (buf[pos] == '\\' && buf[pos + 1] != '\0') {
+            pos++;
+        } else if (buf[pos] == '"') {
+            in_quotes = !in_quotes;
+        } else if (buf[pos] == '\'' && !in_quotes) {
+            in_quotes = 2;
         }
-        fileidx++;
     }
-    free(lastbuf);
-    return NULL;
+    if (!inword)
+        ctx->start = pos;
+
+    const char *word = buf + ctx->start;
+    ctx->variable = word[0] == '$';
+    ctx->command = argidx == 0 && !ctx->variable && strchr(word, '/') == NULL;
+    ctx->dirsonly = argidx > 0 && ((cmdlen == 2 && !strncmp(buf + cmdstart, "cd", 2)) ||
+                                   (cmdlen == 5 && !strncmp(buf + cmdstart, "chdir", 5)));
+
+    /* a new command needs at least a char to go by */
+    if (ctx->command && word[0] == '\0')
+        return 0;
+
+    if (ctx->variable) {
+        ctx->base = ctx->start + 1;
+        return 1;
+    }
+
+    /* the dir part stays as it was typed, the rest is matched */
+    for (pos = 0; word[pos] != '\0'; pos++) {
+        if (word[pos] == '\\' && word[pos + 1] != '\0')
+            pos++;
+        else if (word[pos] == '/')
+            slash = pos + 1;
+    }
+    ctx->base = ctx->start + slash;
+
+    if (slash == 0) {
+        strcpy(ctx->dir, ".");
+        return 1;
+    }
+
+    /* the dir gets listed, so it has to be unescaped */
+    pos = 0;
+    if (word[0] == '~' && word[1] == '/') {
+        dirlen = snprintf(ctx->dir, MAXCURDIRLEN, "%s", homedir);
+        pos = 1;
+    }
+    for (; pos < slash && dirlen < MAXCURDIRLEN - 1; pos++) {
+        if (word[pos] == '\\')
+            pos++;
+        else if (word[pos] == '"' || word[pos] == '\'')
+            continue;
+        ctx->dir[dirlen++] = word[pos];
+    }
+    ctx->dir[dirlen] = '\0';
+    return 1;
 }
 
-/* tab auto-complete */
-void completion(const char *buf, linenoiseCompletions *lc) {
-    /* finds the last element of buf, delimited by spaces */
-    char *firstbuf = strdup(buf), *lastbuf = firstbuf, *lastarg = firstbuf;
-    int bufidx = 0;
+/**
+ * returns the names of all shell variables as a listing
+ * they're copied every time, it's only a few dozen.
+**/
+const struct dir_listing *getvariables() {
+    const struct shell_var *var;
+    size_t len = 0, pos = 0, namelen;
+    int bucket;
+
+    for (bucket = 0; bucket < VAR_BUCKETS; bucket++) {
+        for (var = var_table[bucket]; var; var = var->next) {
+            len += strlen(var->name) + 2;
+        }
+    }
+    variables.names = realloc(variables.names, sizeof(char) * (len + 1));
+    variables.list = realloc(variables.list, sizeof(char *) * (var_c + 1));
+
+    variables.count = 0;
+    for (bucket = 0; bucket < VAR_BUCKETS; bucket++) {
+        for (var = var_table[bucket]; var; var = var->next) {
+            namelen = strlen(var->name);
+            variables.names[pos++] = DT_UNKNOWN;
+            variables.list[variables.count++] = variables.names + pos;
+            memcpy(variables.names + pos, var->name, namelen + 1);
+            pos += namelen + 1;
+        }
+    }
+
+    qsort(variables.list, variables.count, sizeof(char *), namecompare);
+    return &variables;
+}
 
-    while (lastarg[0] == ' ') {
-        lastarg = ++lastbuf;
+/**
+ * returns whether name, from listing, is a dir
+ * the d_type readdir gave us is enough unless it's a link
+ * or the filesystem didn't tell.
+**/
+int listingisdir(const struct dir_listing *listing, const char *name) {
+    char path[MAXCURDIRLEN];
+    size_t len, pos;
+    struct stat st;
+
+    if (name[-1] != DT_LNK && name[-1] != DT_UNKNOWN)
+        return name[-1] == DT_DIR;
+
+    len = snprintf(path, MAXCURDIRLEN, "%s/", listing->path);
+    for (pos = 0; name[pos] != '\0' && len < MAXCURDIRLEN - 1; pos++) {
+        if (name[pos] == '\\')
+            pos++;
+        path[len++] = name[pos];
     }
+    path[len] = '\0';
+
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
 
-    while ((lastbuf = strstr(lastbuf, " ")) != NULL) {
-        lastarg = ++lastbuf;
-        bufidx++;
-        if (strlen(lastarg) < 2)
+/**
+ * offers the commands, aliases and functions starting with
+ * word to heap, with a bonus for being run often. fuzzy
+ * looks at every name instead of just the matching range.
+**/
+void rankcommands(struct candidate_heap *heap, const char *word, int fuzzy) {
+    size_t wordlen = strlen(word), idx;
+    int score;
+
+    for (idx = fuzzy ? 0 : cmdindex_lowerbound(word, wordlen); idx < cmdindex->count; idx++) {
+        const char *name = cmdindex->entries[idx].name;
+        /* without fuzzy, the prefix matches end at the first name that isn't one */
+        if (!fuzzy && strncmp(name, word, wordlen))
+            break;
+        if ((score = matchscore(name, word, wordlen)) == -1)
             continue;
-        if (!strncmp(lastarg, "&& ", 3) || !strncmp(lastarg, "|| ", 3)) {
-            bufidx = -1;
-        } else if (lastarg[0] == ';') {
-            bufidx = -(lastarg[1] == ' ');
-            lastarg++;
-        } else if (*(lastarg - 2) == ';') {
-            bufidx = 0;
+        offercandidate(heap, name, score + usagescore(name), 32, NULL);
+    }
+
+    /* aliases and functions aren't part of the index */
+    unsigned int bucket;
+    struct command_alias *alias;
+    for (bucket = 0; bucket < ALIAS_BUCKETS && alias_c; bucket++) {
+        for (alias = alias_table[bucket]; alias; alias = alias->next) {
+            if ((fuzzy || startswith(alias->alias, word)) && (score = matchscore(alias->alias, word, wordlen)) != -1)
+                offercandidate(heap, alias->alias, score + usagescore(alias->alias), 32, NULL);
+        }
+    }
+
+    struct shell_function *function;
+    for (bucket = 0; bucket < FUNCTION_BUCKETS && function_c; bucket++) {
+        for (function = function_table[bucket]; function; function = function->next) {
+            if ((fuzzy || startswith(function->name, word)) && (score = matchscore(function->name, word, wordlen)) != -1)
+                offercandidate(heap, function->name, score + usagescore(function->name), 32, NULL);
         }
     }
+}
+
+/* offers the names in listing word matches to heap */
+void ranklisting(struct candidate_heap *heap, const struct dir_listing *listing, const char *word, int fuzzy, int color, int dirsonly) {
+    size_t wordlen = strlen(word), idx;
+    int score;
+
+    for (idx = fuzzy ? 0 : listing_lowerbound(listing, word, wordlen); idx < listing->count; idx++) {
+        if (!fuzzy && strncmp(listing->list[idx], word, wordlen))
+            break;
+        if ((score = matchscore(listing->list[idx], word, wordlen)) == -1)
+            continue;
+        /* dot files only if asked for */
+        if (listing->list[idx][0] == '.' && word[0] != '.')
+            continue;
+        if (dirsonly && !listingisdir(listing, listing->list[idx]))
+            continue;
+        offercandidate(heap, listing->list[idx], score, color, listing);
+    }
+}
+
+/* offers everything the word at the end of buf could complete to to heap */
+void rankcompletions(struct candidate_heap *heap, const char *buf, const struct completion_context *ctx, int fuzzy) {
+    const char *word = buf + ctx->base;
 
-    if (lastarg[0] == '\0') {
-        free(firstbuf);
+    if (ctx->variable) {
+        ranklisting(heap, getvariables(), word, fuzzy, 36, 0);
         return;
     }
 
-    /* if we're in the first argument of a command, also autocomplete from the list of commands in PATH */
-    if (bufidx == 0) {
-        int cmdidx = 0;
-        while (commands[cmdidx] != NULL) {
-            if (startswith(commands[cmdidx], lastarg)) {
-                char *tmp = malloc(sizeof(char) * (strlen(firstbuf) + strlen(commands[cmdidx]) - strlen(lastarg) + 1));
-                strcpy(tmp, firstbuf);
-                strcat(tmp, commands[cmdidx] + strlen(lastarg));
-                linenoiseAddCompletion(lc, tmp);
-                free(tmp);
+    if (ctx->command)
+        rankcommands(heap, word, fuzzy);
+    ranklisting(heap, getlisting(ctx->dir), word, fuzzy, 35, ctx->dirsonly);
+}
+
+/* sorts heap best first, it's not a heap anymore afterwards */
+void sortcandidates(struct candidate_heap *heap) {
+    struct candidate worst;
+    int count = heap->count;
+
+    /* popping the worst one every time fills the array from the back */
+    while (heap->count > 1) {
+        worst = heap->items[0];
+        heap->items[0] = heap->items[--heap->count];
+        heap->items[heap->count] = worst;
+        siftcandidate(heap, 0);
+    }
+    heap->count = count;
+}
+
+/* hints */
+char *hints(const char *buf, int *color, int *bold) {
+    static char *preview = NULL;
+    const char *event;
+    size_t speclen;
+
+    /* a line that is just a history event shows what it runs */
+    if (buf[0] == '!' && buf[1] != '\0' && (event = historyevent(buf + 1, &speclen)) != NULL && buf[speclen + 1] == '\0') {
+        free(preview);
+        preview = malloc(sizeof(char) * (strlen(event) + 5));
+        sprintf(preview, "  = %s", event);
+        *color = 90;
+        *bold = 0;
+        return preview;
+    }
+
+    struct completion_context ctx;
+    struct candidate_heap best;
+
+    /* the indexer may have finished while this line was typed */
+    takecommands();
+    if (!completioncontext(buf, &ctx) || buf[ctx.base] == '\0')
+        return NULL;
+
+    /* only the best prefix match can be shown behind the cursor */
+    best.count = 0;
+    best.limit = 1;
+    rankcompletions(&best, buf, &ctx, 0);
+
+    if (best.count == 0 || !startswith(best.items[0].name, buf + ctx.base))
+        return NULL;
+    *color = best.items[0].color;
+    *bold = 0;
+    return ((char *) best.items[0].name + strlen(buf + ctx.base));
+}
+
+/* tab auto-complete */
+void completion(const char *buf, linenoiseCompletions *lc) {
+    /* tab cycles through the lines a !text or !?text event matches, newest first */
+    if (buf[0] == '!' && buf[1] != '\0' && buf[1] != '!' && !isdigit((unsigned char) buf[1]) && buf[1] != '-') {
+        int prefix = buf[1] != '?', idx = history.count, found;
+        const char *text = buf + 1 + !prefix;
+        size_t seen;
+
+        for (found = 0; found < HISTORY_MATCHES && text[0] != '\0' && (idx = historysearch(text, prefix, idx)) != -1; ) {
+            for (seen = 0; seen < lc->len && strcmp(lc->cvec[seen], history.entries[idx]); seen++);
+            if (seen == lc->len) {
+                linenoiseAddCompletion(lc, history.entries[idx]);
+                found++;
             }
-            cmdidx++;
         }
+        if (found > 0)
+            return;
     }
 
-    int fileidx = 0;
-    while (files[fileidx] != NULL) {
-        if (startswith(files[fileidx], lastarg)) {
-            char *tmp = malloc(sizeof(char) * (strlen(firstbuf) + strlen(files[fileidx]) - strlen(lastarg) + 1));
-            strcpy(tmp, firstbuf);
-            strcat(tmp, files[fileidx] + strlen(lastarg));
-            linenoiseAddCompletion(lc, tmp);
-            free(tmp);
-        }
-        fileidx++;
+    /* the best COMPLETION_TOPK, fuzzy once there's more than a char to go by */
+    struct completion_context ctx;
+    struct candidate_heap ranked;
+    size_t longest = 0;
+    int idx, seen;
+
+    takecommands();
+    if (!completioncontext(buf, &ctx))
+        return;
+
+    ranked.count = 0;
+    ranked.limit = COMPLETION_TOPK;
+    rankcompletions(&ranked, buf, &ctx, buf[ctx.base] != '\0' && buf[ctx.base + 1] != '\0');
+    sortcandidates(&ranked);
+
+    for (idx = 0; idx < ranked.count; idx++) {
+        if (strlen(ranked.items[idx].name) > longest)
+            longest = strlen(ranked.items[idx].name);
+    }
+
+    /* every completion is the line up to the match plus a candidate, dirs get their / */
+    char *line = malloc(sizeof(char) * (ctx.base + longest + 2));
+    memcpy(line, buf, ctx.base);
+    for (idx = 0; idx < ranked.count; idx++) {
+        /* a command, an alias and a file can share a name */
+        for (seen = 0; seen < idx && strcmp(ranked.items[seen].name, ranked.items[idx].name); seen++);
+        if (seen < idx)
+            continue;
+        strcpy(line + ctx.base, ranked.items[idx].name);
+        if (ranked.items[idx].listing != NULL && ranked.items[idx].listing != &variables && listingisdir(ranked.items[idx].listing, ranked.items[idx].name))
+            strcat(line + ctx.base, "/");
+        linenoiseAddCompletion(lc, line);
     }
-    free(firstbuf);
+    free(line);
 }
 
 /* print error msg and return non-zero exit value */
@@ -24,6 +24,7 @@
 
 #define DEFAULTPROMPT   "\033[0;95m%1$s\033[0;32m@\033[0;36m%2$s\033[0;32m:\033[0;91m%3$s\033[0;32m$\033[0m "
 #define HISTSIZE        1024
+#define DIRCACHESIZE    16
 
 #define DEBUG_OUTPUT
 
@@ -23,6 +23,6 @@ MANPREFIX = /usr/share/man
 CC = gcc
 LD = $(CC)
 CPPFLAGS =
-CFLAGS   = -Wextra -Wall -Os -g -fsanitize=address
+CFLAGS   = -Wextra -Wall -Os -g -fsanitize=address -pthread
 LDFLAGS  = # -s
-LDLIBS   = -lasan
+LDLIBS   = -lasan -pthread
@@ -0,0 +1,44 @@
+#!/bin/sh
+# this file is part of cbsh
+# regression checks, run by make check
+# usage: tests/regress.sh [path to cbsh]
+
+CBSH=${1:-./cbsh}
+failed=0
+
+# check NAME EXPECTED COMMANDS
+check() {
+    out=$("$CBSH" -c "$3" 2>/dev/null)
+    if [ "$out" != "$2" ]; then
+        printf 'FAIL: %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$out"
+        failed=1
+    fi
+}
+
+check "alias with a pipeline" "HI" 'alias x="echo hi | tr a-z A-Z"; x'
+check "alias with a pipeline, piped" "HI" 'alias x="echo hi | tr a-z A-Z"; x | cat'
+check "alias with a pipeline after |" "HI" 'alias x="echo hi | tr a-z A-Z"; echo yo | x'
+check "alias of an alias with a pipeline" "HI" 'alias x="echo hi | tr a-z A-Z"; alias y=x; y'
+check "alias with a pipeline, used twice" "$(printf 'A\nA')" 'alias x="echo a | tr a-z A-Z"; x; x'
+check "alias starting with a pipe" "" 'alias x="| cat"; x'
+
+check "getenv of a special parameter" "1" 'false; getenv ?'
+check "getenv of a positional parameter" "0" 'getenv "#"'
+
+check "substitution in an assignment" "a b" 'X=$(echo a b); echo "$X"'
+check "substitution in a prefix assignment" "a b" 'X=`echo a b` sh -c "echo \$X"'
+check "substitution in an argument" "$(printf 'a\nb')" 'printf "%s\n" X=$(echo a b) | cut -d= -f2'
+
+check "function defined after ;" "x" 'true; f() { echo x; }; f'
+check "function defined after &&" "x" 'true && f() { echo x; }; f'
+check "function defined after a quoted ;" "a;b()
+x" 'echo "a;b()"; f() { echo x; }; f'
+check "function defined in a comment" "" 'true # ; f() { echo x; }'
+
+check "return 170" "170" 'f() { return 170; }; f; echo $?'
+check "return 186" "186" 'f() { return 186; }; f; echo $?'
+check "return without a status" "1" 'f() { false; return; }; f; echo $?'
+check "return stops the function" "3" 'f() { return 3; echo no; }; f; echo $?'
+
+[ $failed -eq 0 ] && echo "all checks passed"
+exit $failed